@@ -32,17 +32,85 @@
 // Read       - PD5
 // ChipSelect - PD6
 
+///////////////////////////////////////////////////////////
+#include <util/crc16.h>
+
 ///////////////////////////////////////////////////////////
 #define SERIAL_BAUDRATE   ( 500000 )
 #define SEND_CHUNK_SIZE   ( 64     )
+#define RECV_CHUNK_SIZE   ( 32     ) /* must match host SEND_CHUNK_SIZE */
+#define RECV_TIMEOUT      ( 100    ) /* milliseconds */
 
 ///////////////////////////////////////////////////////////
 #define READ_HEADER_COMMAND   0x01
 #define READ_ROM_COMMAND      0x02
 #define READ_RAM_COMMAND      0x03
 #define WRITE_RAM_COMMAND     0x04
+#define INFO_COMMAND          0x05
+#define FLASH_ROM_COMMAND     0x06
+#define READ_ROM_MAP_COMMAND  0x07
+#define READ_RANGE_COMMAND    0x08
+#define CALIBRATE_COMMAND     0x09
+#define SET_BUS_DELAY_COMMAND 0x0A
+#define WATCH_RAM_COMMAND     0x0B
+#define TEST_RAM_COMMAND      0x0C
 #define GET_RAM_SIZE          0xF0
 
+///////////////////////////////////////////////////////////
+#define ACK                   0x06
+#define NAK                   0x15
+
+///////////////////////////////////////////////////////////
+#define PROTOCOL_VERSION      ( 1 )
+
+/* capabilities bitmap sent in INFO_COMMAND reply, 0x0001 and 0x0002 are reserved */
+#define CAP_RANGE_READ        0x0004
+#define CAP_BANK_MAP          0x0008
+#define CAP_BUS_TIMING        0x0010
+#define CAP_RAM_WATCH         0x0020
+#define CAP_RAM_TEST          0x0040
+#define CAPABILITIES          ( CAP_RANGE_READ | CAP_BANK_MAP | CAP_BUS_TIMING | CAP_RAM_WATCH | CAP_RAM_TEST )
+
+/* READ_ROM_MAP_COMMAND bank frames */
+#define BANK_DATA             0x00
+#define BANK_MIRROR           0x01
+#define BANK_BLANK            0x02
+#define MAX_ROM_BANKS         ( 512 )
+
+/* bus timing profiles: nops between /RD low and sampling the data bus */
+#define BUS_DELAY_MAX         ( 7 )
+#define BUS_DELAY_DEFAULT     ( 3 )
+#define BUS_DELAY_MARGIN      ( 1 )
+#define CALIBRATE_PASSES      ( 3 )
+
+/* WATCH_RAM_COMMAND frames: TIME(4) + BLOCK(2) + DATA, BLOCK 0xFFFF ends a pass */
+#define WATCH_BLOCK_SIZE      ( 256 )
+#define WATCH_MAX_BLOCKS      ( 0x20000 / WATCH_BLOCK_SIZE )
+#define WATCH_END_OF_PASS     0xFFFF
+
+/* TEST_RAM_COMMAND frames */
+#define TEST_PROGRESS         0x00 /* + ADDRESS(4), sent before every chunk */
+#define TEST_FAIL             0x01 /* + TEST + ADDRESS(4) + EXPECTED + ACTUAL */
+#define TEST_DONE             0x02 /* + FAILURES(4) + CRC16 of every bank */
+#define TEST_DATA_BUS         0x01
+#define TEST_ADDRESS_BUS      0x02
+#define TEST_MARCH            0x03
+#define TEST_RESTORE          0x04
+#define TEST_CHUNK_SIZE       ( 512 )
+#define TEST_MAX_FAILURES     ( 32  )
+
+/* READ_RANGE_COMMAND areas */
+#define AREA_ROM              0x00
+#define AREA_RAM              0x01
+
+/* FLASH_ROM_COMMAND constants, the code is included with the bus below */
+#include "flash-rom.h"
+
+/* INFO_COMMAND reply: header 0x0100-0x014F + ROM size(4) + RAM size(4) + version(1) + capabilities(2) */
+#define INFO_HEADER_START     0x0100
+#define INFO_HEADER_SIZE      0x50
+#define INFO_PACKET_SIZE      ( INFO_HEADER_SIZE + 4 + 4 + 1 + 2 )
+
 ///////////////////////////////////////////////////////////
 #define WritePinLow()         ( PORTD &= ~(1<<PD4)                     )
 #define WritePinHigh()        ( PORTD |= (1<<PD4)                      )
@@ -60,7 +128,7 @@
 #define GetROMBanks()         ( (RomSize >= 1 ? (2 << RomSize) : 2) )
 
 ///////////////////////////////////////////////////////////
-#define LongFromArray(R(B)   ( ((unsigned long)B[0] << 24) | ((unsigned long)B[1] << 16) | ((unsigned long)B[2] << 8) | (unsigned long)B[3]          )
+#define LongFromArray(B)     ( ((unsigned long)B[0] << 24) | ((unsigned long)B[1] << 16) | ((unsigned long)B[2] << 8) | (unsigned long)B[3]          )
 #define LongToArray(B, L)    ( B[0] = ((L & 0xFF000000LU) >> 24), B[1] = ((L & 0xFF0000LU) >> 16), B[2] = ((L & 0xFF00LU) >> 8), B[3] = (L & 0xFFLU) )
 
 ///////////////////////////////////////////////////////////
@@ -72,6 +140,19 @@
 unsigned char CartridgeType;
 unsigned char RomSize;
 unsigned char RamSize;
+unsigned char BusDelay = BUS_DELAY_DEFAULT;
+unsigned char CalibratedCart[3]; /* header 0x014D-0x014F of the cartridge BusDelay is for */
+
+/* buffers of the commands that need one, a single command runs at a time */
+union {
+  struct {
+    unsigned short Fingerprints[MAX_ROM_BANKS]; /* CRC16 per bank; collisions are ruled out by CompareBanks() */
+    unsigned char Unique[MAX_ROM_BANKS / 8];
+  } Bank;                                            /* READ_ROM_MAP_COMMAND */
+  unsigned short WatchFingerprints[WATCH_MAX_BLOCKS]; /* WATCH_RAM_COMMAND */
+  unsigned char TestBackup[TEST_CHUNK_SIZE];          /* TEST_RAM_COMMAND */
+  unsigned char FlashBlocks[2][FLASH_BLOCK_SIZE];     /* FLASH_ROM_COMMAND */
+} Scratch;
 
 ///////////////////////////////////////////////////////////
 void SendPacketSize(unsigned long L)
@@ -82,6 +163,32 @@ void SendPacketSize(unsigned long L)
   Serial.write((L & 0xFFU       )      );
 }
 
+///////////////////////////////////////////////////////////
+void SendAck(unsigned char code)
+{
+  Serial.write(0x10);
+  Serial.write(ACK);
+  Serial.write(code);
+}
+
+///////////////////////////////////////////////////////////
+void SendNak(unsigned char code)
+{
+  Serial.write(0x10);
+  Serial.write(NAK);
+  Serial.write(code);
+}
+
+///////////////////////////////////////////////////////////
+int RecvByte()
+{
+  unsigned long start = millis();
+  while (Serial.available() <= 0) {
+    if ((millis() - start) > RECV_TIMEOUT) return -1;
+  }
+  return Serial.read();
+}
+
 ///////////////////////////////////////////////////////////
 void ResetVariables()
 {
@@ -98,19 +205,86 @@ void WriteAddress(unsigned int address)
 }
 
 ///////////////////////////////////////////////////////////
-unsigned char ReadByte(unsigned int address)
+template <unsigned char N>
+struct Wait {
+  static inline void Nops() {
+    asm volatile("nop"); // volatile to ensure optimizations don't remove it
+    Wait<N - 1>::Nops();
+  }
+};
+
+template <>
+struct Wait<0> {
+  static inline void Nops() {}
+};
+
+///////////////////////////////////////////////////////////
+/* read cycles for each timing profile, picked at runtime by the caller:
+ * BusDelay for ROM, BUS_DELAY_DEFAULT for RAM and flash which are never calibrated */
+template <unsigned char N>
+struct Bus {
+  static unsigned char Read(unsigned int address)
+  {
+    unsigned char result;
+    WriteAddress(address);
+    ChipSelectPinLow();
+    ReadPinLow();
+    Wait<N>::Nops();
+    result = PINB;
+    ReadPinHigh();
+    ChipSelectPinHigh();
+    return result;
+  }
+
+  /* sequential reads: A8-A15 (PORTA) only change every 256 bytes */
+  static void ReadBlock(unsigned int address, unsigned char *buffer, unsigned short length)
+  {
+    unsigned char low = address & 0xFF;
+    unsigned char high = (address >> 8) & 0xFF;
+
+    PORTA = high;
+    while (length--) {
+      PORTC = low;
+      ChipSelectPinLow();
+      ReadPinLow();
+      Wait<N>::Nops();
+      *buffer++ = PINB;
+      ReadPinHigh();
+      ChipSelectPinHigh();
+      if (++low == 0) PORTA = ++high;
+    }
+  }
+};
+
+///////////////////////////////////////////////////////////
+unsigned char ReadByte(unsigned int address, unsigned char delay)
 {
-  unsigned char result;
-  WriteAddress(address);
-  ChipSelectPinLow();
-  ReadPinLow();
-  asm volatile("nop"); // volatile to ensure optimizations don't remove it
-  asm volatile("nop");
-  asm volatile("nop");
-  result = PINB;
-  ReadPinHigh();
-  ChipSelectPinHigh();
-  return result;
+  switch (delay) {
+    case 0: return Bus<0>::Read(address);
+    case 1: return Bus<1>::Read(address);
+    case 2: return Bus<2>::Read(address);
+    case 3: return Bus<3>::Read(address);
+    case 4: return Bus<4>::Read(address);
+    case 5: return Bus<5>::Read(address);
+    case 6: return Bus<6>::Read(address);
+    default: break;
+  }
+  return Bus<BUS_DELAY_MAX>::Read(address);
+}
+
+///////////////////////////////////////////////////////////
+void ReadBlock(unsigned int address, unsigned char *buffer, unsigned short length, unsigned char delay)
+{
+  switch (delay) {
+    case 0: Bus<0>::ReadBlock(address, buffer, length); break;
+    case 1: Bus<1>::ReadBlock(address, buffer, length); break;
+    case 2: Bus<2>::ReadBlock(address, buffer, length); break;
+    case 3: Bus<3>::ReadBlock(address, buffer, length); break;
+    case 4: Bus<4>::ReadBlock(address, buffer, length); break;
+    case 5: Bus<5>::ReadBlock(address, buffer, length); break;
+    case 6: Bus<6>::ReadBlock(address, buffer, length); break;
+    default: Bus<BUS_DELAY_MAX>::ReadBlock(address, buffer, length); break;
+  }
 }
 
 ///////////////////////////////////////////////////////////
@@ -138,12 +312,12 @@ void WriteByteRAM(unsigned int address, unsigned char data)
 }
 
 ///////////////////////////////////////////////////////////
-unsigned char ValidateChecksum()
+unsigned char ValidateChecksum(unsigned char delay)
 {
   int i;
   int checksum = 0;
   for (i = 0x0134; i < 0x014E; i++) {
-    checksum += ReadByte(i);
+    checksum += ReadByte(i, delay);
   }
   return (((checksum + 25) & 0xFF) == 0);
 }
@@ -181,20 +355,102 @@ unsigned long GetMaxAddressRAM()
 }
 
 ///////////////////////////////////////////////////////////
-void SwitchROMBank(unsigned short bank)
+unsigned long GetRAMSizeBytes()
 {
-  if (CartridgeType >= 5) {
-    WriteByte(0x2100, bank);
-  }
-  else {
-    /* 00h: ROM only          */
-    /* 01h: MBC1              */
-    /* 02h: MBC1 + RAM        */
-    /* 03h: MBC1 + RAM + BATT */
-    WriteByte(0x6000, 0);
+  if (RamSize == 0) return 0;
+  return GetRAMBanks() * (GetMaxAddressRAM() - 0xA000UL);
+}
+
+///////////////////////////////////////////////////////////
+/* Mapper families: the dump and range loops are instantiated per family so a bank
+ * switch is only the register writes that mapper needs. Begin() runs once per command. */
+#define MAPPER_ROM_ONLY       0
+#define MAPPER_MBC1           1
+#define MAPPER_MBC2           2
+#define MAPPER_MBC3           3
+#define MAPPER_MBC5           4
+#define MAPPER_GENERIC        5
+
+struct MapperROMOnly {
+  static inline void Begin() {}
+  static inline void SelectROMBank(unsigned short /*bank*/) {}
+};
+
+struct MapperMBC1 {
+  /* ROM banking mode, upper 2 bits go to 0x4000 */
+  static inline void Begin() { WriteByte(0x6000, 0); }
+  static inline void SelectROMBank(unsigned short bank) {
     WriteByte(0x4000, bank >> 5);
     WriteByte(0x2000, bank & 0x1F);
   }
+};
+
+struct MapperMBC2 {
+  /* A8 set selects the ROM bank register */
+  static inline void Begin() {}
+  static inline void SelectROMBank(unsigned short bank) { WriteByte(0x2100, bank & 0x0F); }
+};
+
+struct MapperMBC3 {
+  static inline void Begin() {}
+  static inline void SelectROMBank(unsigned short bank) { WriteByte(0x2000, bank & 0xFF); }
+};
+
+struct MapperMBC5 {
+  /* 9-bit bank number, bit 8 at 0x3000 for 8MB ROMs */
+  static inline void Begin() {}
+  static inline void SelectROMBank(unsigned short bank) {
+    WriteByte(0x2000, bank & 0xFF);
+    WriteByte(0x3000, (bank >> 8) & 0x01);
+  }
+};
+
+struct MapperGeneric {
+  static inline void Begin() {}
+  static inline void SelectROMBank(unsigned short bank) {
+    if (CartridgeType >= 5) {
+      WriteByte(0x2100, bank);
+    }
+    else {
+      WriteByte(0x6000, 0);
+      WriteByte(0x4000, bank >> 5);
+      WriteByte(0x2000, bank & 0x1F);
+    }
+  }
+};
+
+///////////////////////////////////////////////////////////
+unsigned char GetMapper()
+{
+  switch (CartridgeType) {
+    case 0x00: /* ROM only */
+    case 0x08: /* ROM + RAM */
+    case 0x09: /* ROM + RAM + BATT */
+      return MAPPER_ROM_ONLY;
+    case 0x01: /* MBC1 */
+    case 0x02: /* MBC1 + RAM */
+    case 0x03: /* MBC1 + RAM + BATT */
+      return MAPPER_MBC1;
+    case 0x05: /* MBC2 */
+    case 0x06: /* MBC2 + BATT */
+      return MAPPER_MBC2;
+    case 0x0F: /* MBC3 + TIMER + BATT */
+    case 0x10: /* MBC3 + TIMER + RAM + BATT */
+    case 0x11: /* MBC3 */
+    case 0x12: /* MBC3 + RAM */
+    case 0x13: /* MBC3 + RAM + BATT */
+      return MAPPER_MBC3;
+    case 0x19: /* MBC5 */
+    case 0x1A: /* MBC5 + RAM */
+    case 0x1B: /* MBC5 + RAM + BATT */
+    case 0x1C: /* MBC5 + RUMBLE */
+    case 0x1D: /* MBC5 + RUMBLE + RAM */
+    case 0x1E: /* MBC5 + RUMBLE + RAM + BATT */
+      return MAPPER_MBC5;
+    default:
+      break;
+  }
+  return MAPPER_GENERIC;
 }
 
 ///////////////////////////////////////////////////////////
@@ -208,7 +464,7 @@ void ReadSendHeader()
   ControlPinsHigh();
 
   for (i = 0x0134; i < 0x0143; i++) {
-    romTitle[i - 0x0134] = ReadByte(i);
+    romTitle[i - 0x0134] = ReadByte(i, BusDelay);
   }
   romTitle[i - 0x0134] = '\0';
 
@@ -218,11 +474,11 @@ void ReadSendHeader()
     romInfo[i++] = romTitle[j];
   }
   romInfo[i++] = '\0';
-  romInfo[i++] = CartridgeType = ReadByte(0x0147);
-  romInfo[i++] = RomSize = ReadByte(0x0148);
-  romInfo[i++] = RamSize = ReadByte(0x0149);
-  romInfo[i++] = ReadByte(0x014C);
-  romInfo[i++] = ValidateChecksum();
+  romInfo[i++] = CartridgeType = ReadByte(0x0147, BusDelay);
+  romInfo[i++] = RomSize = ReadByte(0x0148, BusDelay);
+  romInfo[i++] = RamSize = ReadByte(0x0149, BusDelay);
+  romInfo[i++] = ReadByte(0x014C, BusDelay);
+  romInfo[i++] = ValidateChecksum(BusDelay);
 
   ControlPinsLow();
 
@@ -232,14 +488,206 @@ void ReadSendHeader()
   Serial.write(romInfo, i);
 }
 
+///////////////////////////////////////////////////////////
+void ReadSendInfo()
+{
+  unsigned int i;
+  unsigned long size;
+  unsigned char *sizeBytes;
+  unsigned char info[INFO_PACKET_SIZE];
+
+  ControlPinsHigh();
+
+  ReadBlock(INFO_HEADER_START, info, INFO_HEADER_SIZE, BUS_DELAY_DEFAULT);
+
+  ControlPinsLow();
+
+  /* header read with the default profile, a different cartridge drops the calibrated one */
+  if (memcmp(CalibratedCart, info + (0x014D - INFO_HEADER_START), sizeof(CalibratedCart))) BusDelay = BUS_DELAY_DEFAULT;
+  i = INFO_HEADER_SIZE;
+
+  CartridgeType = info[0x0147 - INFO_HEADER_START];
+  RomSize = info[0x0148 - INFO_HEADER_START];
+  RamSize = info[0x0149 - INFO_HEADER_START];
+
+  sizeBytes = info + i;
+  size = GetROMBanks() * 0x4000LU;
+  LongToArray(sizeBytes, size);
+  i += 4;
+
+  sizeBytes = info + i;
+  size = GetRAMSizeBytes();
+  LongToArray(sizeBytes, size);
+  i += 4;
+
+  info[i++] = PROTOCOL_VERSION;
+  info[i++] = (CAPABILITIES >> 8) & 0xFF;
+  info[i++] = CAPABILITIES & 0xFF;
+
+  Serial.write(0x10);
+  Serial.write(0x02);
+  SendPacketSize(i);
+  Serial.write(info, i);
+}
+
+///////////////////////////////////////////////////////////
+#define IsBankUnique(B)       ( Scratch.Bank.Unique[(B) >> 3] & (1 << ((B) & 7)) )
+
+///////////////////////////////////////////////////////////
+unsigned short FingerprintBank(unsigned int base, unsigned char *blank)
+{
+  unsigned int i;
+  unsigned char j;
+  unsigned char all = 0xFF;
+  unsigned short crc = 0;
+  unsigned char chunk[SEND_CHUNK_SIZE];
+
+  for (i = 0; i < 0x4000; i += SEND_CHUNK_SIZE) {
+    ReadBlock(base + i, chunk, SEND_CHUNK_SIZE, BusDelay);
+    for (j = 0; j < SEND_CHUNK_SIZE; j++) {
+      crc = _crc_xmodem_update(crc, chunk[j]);
+      all &= chunk[j];
+    }
+  }
+
+  *blank = (all == 0xFF);
+  return crc;
+}
+
+///////////////////////////////////////////////////////////
+void SendBankFrame(unsigned char type, unsigned short source)
+{
+  Serial.write(0x10);
+  Serial.write(0x02);
+  if (type == BANK_MIRROR) {
+    SendPacketSize(3);
+    Serial.write(BANK_MIRROR);
+    Serial.write((source >> 8) & 0xFF);
+    Serial.write(source & 0xFF);
+  }
+  else if (type == BANK_BLANK) {
+    SendPacketSize(1);
+    Serial.write(BANK_BLANK);
+  }
+  else {
+    SendPacketSize(1 + 0x4000LU);
+    Serial.write(BANK_DATA);
+  }
+}
+
+///////////////////////////////////////////////////////////
+void SendRangeBlocks(unsigned int address, unsigned short length, unsigned char delay)
+{
+  unsigned char c;
+  unsigned char sendChunk[SEND_CHUNK_SIZE];
+
+  while (length > 0) {
+    c = (length > SEND_CHUNK_SIZE) ? SEND_CHUNK_SIZE : length;
+    ReadBlock(address, sendChunk, c, delay);
+    Serial.write(sendChunk, c);
+    address += c;
+    length -= c;
+  }
+}
+
+///////////////////////////////////////////////////////////
+template <class Mapper>
+struct ROMDump {
+  static void SendBank(unsigned int base)
+  {
+    unsigned int i;
+    unsigned char sendChunk[SEND_CHUNK_SIZE];
+
+    for (i = 0; i < 0x4000; i += SEND_CHUNK_SIZE) {
+      ReadBlock(base + i, sendChunk, SEND_CHUNK_SIZE, BusDelay);
+      Serial.write(sendChunk, SEND_CHUNK_SIZE);
+    }
+  }
+
+  static void Send(unsigned short romBanks)
+  {
+    unsigned short bank;
+
+    Mapper::Begin();
+    SendBank(0x0000);
+    for (bank = 1; bank < romBanks; bank++) {
+      Mapper::SelectROMBank(bank);
+      SendBank(0x4000);
+    }
+  }
+
+  /* leaves bank mapped at 0x4000 */
+  static unsigned char CompareBanks(unsigned short bank, unsigned short source)
+  {
+    unsigned int i;
+    unsigned char j;
+    unsigned char chunk[SEND_CHUNK_SIZE];
+    unsigned char other[SEND_CHUNK_SIZE];
+
+    for (i = 0; i < 0x4000; i += SEND_CHUNK_SIZE) {
+      if (source == 0) {
+        ReadBlock(i, other, SEND_CHUNK_SIZE, BusDelay);
+      }
+      else {
+        Mapper::SelectROMBank(source);
+        ReadBlock(0x4000 + i, other, SEND_CHUNK_SIZE, BusDelay);
+        Mapper::SelectROMBank(bank);
+      }
+      ReadBlock(0x4000 + i, chunk, SEND_CHUNK_SIZE, BusDelay);
+      for (j = 0; j < SEND_CHUNK_SIZE; j++) {
+        if (chunk[j] != other[j]) return 0;
+      }
+    }
+
+    return 1;
+  }
+
+  static void SendMap(unsigned short romBanks)
+  {
+    unsigned short bank;
+    unsigned short source;
+    unsigned int base;
+    unsigned char blank;
+
+    Mapper::Begin();
+    for (bank = 0; bank < romBanks; bank++) {
+      base = bank ? 0x4000 : 0x0000;
+      if (bank) Mapper::SelectROMBank(bank);
+
+      Scratch.Bank.Fingerprints[bank] = FingerprintBank(base, &blank);
+      Scratch.Bank.Unique[bank >> 3] &= ~(1 << (bank & 7));
+
+      if (blank) {
+        SendBankFrame(BANK_BLANK, 0);
+        continue;
+      }
+
+      for (source = 0; source < bank; source++) {
+        if (IsBankUnique(source) && (Scratch.Bank.Fingerprints[source] == Scratch.Bank.Fingerprints[bank]) && CompareBanks(bank, source)) break;
+      }
+      if (source < bank) {
+        SendBankFrame(BANK_MIRROR, source);
+        continue;
+      }
+
+      Scratch.Bank.Unique[bank >> 3] |= (1 << (bank & 7));
+      SendBankFrame(BANK_DATA, 0);
+      SendBank(base);
+    }
+  }
+
+  static void SendRange(unsigned short bank, unsigned short offset, unsigned short length)
+  {
+    Mapper::Begin();
+    if (bank) Mapper::SelectROMBank(bank);
+    SendRangeBlocks((bank ? 0x4000 : 0x0000) + offset, length, BusDelay);
+  }
+};
+
 ///////////////////////////////////////////////////////////
 void ReadSendROM()
 {
-  unsigned short i;
-  unsigned short bank;
   unsigned short romBanks = GetROMBanks();
-  unsigned int romAddress;
-  unsigned char sendChunk[SEND_CHUNK_SIZE];
 
   Serial.write(0x10);
   Serial.write(0x02);
@@ -247,29 +695,451 @@ void ReadSendROM()
 
   ControlPinsHigh();
 
-  romAddress = 0;
-  SwitchROMBank(1);
-  while (romAddress <= 0x7FFF) {
-    for (i = 0; i < SEND_CHUNK_SIZE; i++) {
-      sendChunk[i] = ReadByte(romAddress + i);
+  switch (GetMapper()) {
+    case MAPPER_ROM_ONLY:
+      ROMDump<MapperROMOnly>::Send(romBanks);
+      break;
+    case MAPPER_MBC1:
+      ROMDump<MapperMBC1>::Send(romBanks);
+      break;
+    case MAPPER_MBC2:
+      ROMDump<MapperMBC2>::Send(romBanks);
+      break;
+    case MAPPER_MBC3:
+      ROMDump<MapperMBC3>::Send(romBanks);
+      break;
+    case MAPPER_MBC5:
+      ROMDump<MapperMBC5>::Send(romBanks);
+      break;
+    default:
+      ROMDump<MapperGeneric>::Send(romBanks);
+      break;
+  }
+
+  ControlPinsLow();
+}
+
+///////////////////////////////////////////////////////////
+void ReadSendROMMap()
+{
+  unsigned short romBanks = GetROMBanks();
+
+  if (romBanks > MAX_ROM_BANKS) romBanks = MAX_ROM_BANKS;
+
+  /* Send: banks count, then one frame per bank: DATA + 16KB, MIRROR + source bank or BLANK */
+  Serial.write(0x10);
+  Serial.write(0x02);
+  SendPacketSize(2);
+  Serial.write((romBanks >> 8) & 0xFF);
+  Serial.write(romBanks & 0xFF);
+
+  ControlPinsHigh();
+
+  switch (GetMapper()) {
+    case MAPPER_ROM_ONLY:
+      ROMDump<MapperROMOnly>::SendMap(romBanks);
+      break;
+    case MAPPER_MBC1:
+      ROMDump<MapperMBC1>::SendMap(romBanks);
+      break;
+    case MAPPER_MBC2:
+      ROMDump<MapperMBC2>::SendMap(romBanks);
+      break;
+    case MAPPER_MBC3:
+      ROMDump<MapperMBC3>::SendMap(romBanks);
+      break;
+    case MAPPER_MBC5:
+      ROMDump<MapperMBC5>::SendMap(romBanks);
+      break;
+    default:
+      ROMDump<MapperGeneric>::SendMap(romBanks);
+      break;
+  }
+
+  ControlPinsLow();
+}
+
+///////////////////////////////////////////////////////////
+void ReadSendRange()
+{
+  int c;
+  unsigned char i;
+  unsigned char area;
+  unsigned char params[7];
+  unsigned short bank;
+  unsigned short offset;
+  unsigned short length;
+  unsigned short bankSize;
+  unsigned short bankCount;
+
+  /* Need: AREA + BANK(2) + OFFSET(2) + LENGTH(2) */
+  for (i = 0; i < sizeof(params); i++) {
+    if ((c = RecvByte()) < 0) break;
+    params[i] = c;
+  }
+  area = params[0];
+  bank = ((unsigned short)params[1] << 8) | params[2];
+  offset = ((unsigned short)params[3] << 8) | params[4];
+  length = ((unsigned short)params[5] << 8) | params[6];
+
+  if (area == AREA_RAM) {
+    bankCount = RamSize ? GetRAMBanks() : 0;
+    bankSize = RamSize ? (GetMaxAddressRAM() - 0xA000UL) : 0;
+  }
+  else {
+    bankCount = GetROMBanks();
+    bankSize = 0x4000;
+  }
+
+  /* an empty packet tells the host the range is not valid */
+  Serial.write(0x10);
+  Serial.write(0x02);
+  if ((i < sizeof(params)) || (area > AREA_RAM) || (bank >= bankCount) || (length == 0) ||
+      (offset >= bankSize) || (length > (bankSize - offset))) {
+    SendPacketSize(0);
+    return;
+  }
+  SendPacketSize(length);
+
+  ControlPinsHigh();
+
+  if (area == AREA_RAM) {
+    // some MBC2 fix apparently needed
+    ReadByte(0x0134, BUS_DELAY_DEFAULT);
+
+    // some MBC1 fix apparently needed, to set RAM mode
+    if (CartridgeType <= 4) WriteByte(0x6000, 1);
+
+    EnableRAM();
+    SwitchRAMBank(bank);
+    SendRangeBlocks(0xA000 + offset, length, BUS_DELAY_DEFAULT);
+    DisableRAM();
+  }
+  else {
+    switch (GetMapper()) {
+      case MAPPER_ROM_ONLY:
+        ROMDump<MapperROMOnly>::SendRange(bank, offset, length);
+        break;
+      case MAPPER_MBC1:
+        ROMDump<MapperMBC1>::SendRange(bank, offset, length);
+        break;
+      case MAPPER_MBC2:
+        ROMDump<MapperMBC2>::SendRange(bank, offset, length);
+        break;
+      case MAPPER_MBC3:
+        ROMDump<MapperMBC3>::SendRange(bank, offset, length);
+        break;
+      case MAPPER_MBC5:
+        ROMDump<MapperMBC5>::SendRange(bank, offset, length);
+        break;
+      default:
+        ROMDump<MapperGeneric>::SendRange(bank, offset, length);
+        break;
     }
-    Serial.write(sendChunk, SEND_CHUNK_SIZE);
-    romAddress += SEND_CHUNK_SIZE;
   }
 
-  for (bank = 2; bank < romBanks; bank++) {
-    romAddress = 0x4000;
-    SwitchROMBank(bank);
-    while (romAddress <= 0x7FFF) {
-      for (i = 0; i < SEND_CHUNK_SIZE; i++) {
-        sendChunk[i] = ReadByte(romAddress + i);
+  ControlPinsLow();
+}
+
+///////////////////////////////////////////////////////////
+void SendWatchFrame(unsigned short block, const unsigned char *data)
+{
+  unsigned char head[6];
+  unsigned char *timeBytes = head;
+  unsigned long now = millis();
+
+  LongToArray(timeBytes, now);
+  head[4] = (block >> 8) & 0xFF;
+  head[5] = block & 0xFF;
+
+  Serial.write(0x10);
+  Serial.write(0x02);
+  SendPacketSize(data ? (sizeof(head) + WATCH_BLOCK_SIZE) : sizeof(head));
+  Serial.write(head, sizeof(head));
+  if (data) Serial.write(data, WATCH_BLOCK_SIZE);
+}
+
+///////////////////////////////////////////////////////////
+void WatchRAM()
+{
+  unsigned char bank;
+  unsigned char ramBanks;
+  unsigned char first;
+  unsigned short i;
+  unsigned short crc;
+  unsigned short block;
+  unsigned int ramAddress;
+  unsigned int ramMaxAddress;
+  unsigned char data[WATCH_BLOCK_SIZE];
+
+  if (RamSize == 0) {
+    SendAck(WATCH_RAM_COMMAND);
+    return;
+  }
+
+  ramBanks = GetRAMBanks();
+  ramMaxAddress = GetMaxAddressRAM();
+
+  /* first pass sends every block, later passes only the ones whose CRC changed,
+   * until the host sends any byte */
+  first = 1;
+  while (Serial.available() <= 0) {
+    ControlPinsHigh();
+
+    // some MBC2 fix apparently needed
+    ReadByte(0x0134, BUS_DELAY_DEFAULT);
+
+    // some MBC1 fix apparently needed, to set RAM mode
+    if (CartridgeType <= 4) WriteByte(0x6000, 1);
+
+    EnableRAM();
+
+    block = 0;
+    for (bank = 0; bank < ramBanks; bank++) {
+      SwitchRAMBank(bank);
+      for (ramAddress = 0xA000; ramAddress < ramMaxAddress; ramAddress += WATCH_BLOCK_SIZE) {
+        ReadBlock(ramAddress, data, WATCH_BLOCK_SIZE, BUS_DELAY_DEFAULT);
+        crc = 0;
+        for (i = 0; i < WATCH_BLOCK_SIZE; i++) {
+          crc = _crc_xmodem_update(crc, data[i]);
+        }
+        if (first || (crc != Scratch.WatchFingerprints[block])) {
+          Scratch.WatchFingerprints[block] = crc;
+          SendWatchFrame(block, data);
+        }
+        block++;
       }
-      Serial.write(sendChunk, SEND_CHUNK_SIZE);
-      romAddress += SEND_CHUNK_SIZE;
     }
+
+    /* RAM stays protected between passes */
+    DisableRAM();
+
+    ControlPinsLow();
+
+    SendWatchFrame(WATCH_END_OF_PASS, NULL);
+    first = 0;
   }
 
-  ControlPinsLow();
+  while (Serial.available()) Serial.read(); /* discard */
+  SendAck(WATCH_RAM_COMMAND);
+}
+
+///////////////////////////////////////////////////////////
+/* RAM test state, addresses are offsets in the whole RAM (bank * bank size + offset) */
+unsigned char TestBank;
+unsigned char TestMask;
+unsigned short TestBankSize;
+unsigned long TestFailures;
+
+///////////////////////////////////////////////////////////
+unsigned int TestAddress(unsigned long address)
+{
+  unsigned char bank = address / TestBankSize;
+  if (bank != TestBank) {
+    SwitchRAMBank(bank);
+    TestBank = bank;
+  }
+  return 0xA000 + (address % TestBankSize);
+}
+
+///////////////////////////////////////////////////////////
+void TestFail(unsigned char test, unsigned long address, unsigned char expected, unsigned char actual)
+{
+  unsigned char frame[8];
+  unsigned char *addressBytes = frame + 2;
+
+  /* only the first ones are reported, the rest is counted */
+  if (++TestFailures > TEST_MAX_FAILURES) return;
+
+  frame[0] = TEST_FAIL;
+  frame[1] = test;
+  LongToArray(addressBytes, address);
+  frame[6] = expected;
+  frame[7] = actual;
+  Serial.write(0x10);
+  Serial.write(0x02);
+  SendPacketSize(sizeof(frame));
+  Serial.write(frame, sizeof(frame));
+}
+
+///////////////////////////////////////////////////////////
+inline void TestExpect(unsigned char test, unsigned int busAddress, unsigned long address, unsigned char expected)
+{
+  unsigned char actual = ReadByte(busAddress, BUS_DELAY_DEFAULT);
+  if ((actual ^ expected) & TestMask) TestFail(test, address, expected, actual);
+}
+
+///////////////////////////////////////////////////////////
+void TestDataBus()
+{
+  unsigned char bit;
+  unsigned char saved;
+  unsigned int busAddress = TestAddress(0);
+
+  /* walking ones on a single address */
+  saved = ReadByte(busAddress, BUS_DELAY_DEFAULT);
+  for (bit = 0x01; bit; bit <<= 1) {
+    WriteByteRAM(busAddress, bit);
+    TestExpect(TEST_DATA_BUS, busAddress, 0, bit);
+  }
+  WriteByteRAM(busAddress, saved);
+}
+
+///////////////////////////////////////////////////////////
+void TestAddressBus(unsigned long size)
+{
+  unsigned char i;
+  unsigned char j;
+  unsigned char count;
+  unsigned char saved[18];
+  unsigned long offsets[18];
+
+  /* address 0 and every power of two, bank bits included */
+  count = 0;
+  offsets[count++] = 0;
+  while ((offsets[count - 1] ? (offsets[count - 1] << 1) : 1) < size) {
+    offsets[count] = offsets[count - 1] ? (offsets[count - 1] << 1) : 1;
+    count++;
+  }
+
+  for (i = 0; i < count; i++) saved[i] = ReadByte(TestAddress(offsets[i]), BUS_DELAY_DEFAULT);
+  for (i = 0; i < count; i++) WriteByteRAM(TestAddress(offsets[i]), 0xAA);
+
+  /* address bits stuck high */
+  WriteByteRAM(TestAddress(0), 0x55);
+  for (i = 1; i < count; i++) TestExpect(TEST_ADDRESS_BUS, TestAddress(offsets[i]), offsets[i], 0xAA);
+  WriteByteRAM(TestAddress(0), 0xAA);
+
+  /* address bits stuck low or shorted */
+  for (i = 1; i < count; i++) {
+    WriteByteRAM(TestAddress(offsets[i]), 0x55);
+    for (j = 0; j < count; j++) {
+      if (j != i) TestExpect(TEST_ADDRESS_BUS, TestAddress(offsets[j]), offsets[j], 0xAA);
+    }
+    WriteByteRAM(TestAddress(offsets[i]), 0xAA);
+  }
+
+  for (i = 0; i < count; i++) WriteByteRAM(TestAddress(offsets[i]), saved[i]);
+}
+
+///////////////////////////////////////////////////////////
+void TestMarchChunk(unsigned long address, unsigned short length)
+{
+  unsigned short i;
+  unsigned char k;
+  unsigned char p;
+  unsigned char q;
+  unsigned int busAddress = TestAddress(address);
+  const unsigned char patterns[2] = { 0x00, 0x55 };
+
+  /* the chunk is kept in the MCU while it's tested */
+  ReadBlock(busAddress, Scratch.TestBackup, length, BUS_DELAY_DEFAULT);
+
+  /* March C-: (w0) up(r0,w1) up(r1,w0) down(r0,w1) down(r1,w0) (r0) */
+  for (k = 0; k < sizeof(patterns); k++) {
+    p = patterns[k];
+    q = ~p;
+    for (i = 0; i < length; i++) WriteByteRAM(busAddress + i, p);
+    for (i = 0; i < length; i++) {
+      TestExpect(TEST_MARCH, busAddress + i, address + i, p);
+      WriteByteRAM(busAddress + i, q);
+    }
+    for (i = 0; i < length; i++) {
+      TestExpect(TEST_MARCH, busAddress + i, address + i, q);
+      WriteByteRAM(busAddress + i, p);
+    }
+    for (i = length; i-- > 0;) {
+      TestExpect(TEST_MARCH, busAddress + i, address + i, p);
+      WriteByteRAM(busAddress + i, q);
+    }
+    for (i = length; i-- > 0;) {
+      TestExpect(TEST_MARCH, busAddress + i, address + i, q);
+      WriteByteRAM(busAddress + i, p);
+    }
+    for (i = 0; i < length; i++) TestExpect(TEST_MARCH, busAddress + i, address + i, p);
+  }
+
+  for (i = 0; i < length; i++) WriteByteRAM(busAddress + i, Scratch.TestBackup[i]);
+  for (i = 0; i < length; i++) TestExpect(TEST_RESTORE, busAddress + i, address + i, Scratch.TestBackup[i]);
+}
+
+///////////////////////////////////////////////////////////
+void TestRAM()
+{
+  unsigned char i;
+  unsigned char bank;
+  unsigned char ramBanks = 0;
+  unsigned char frame[1 + 4 + (16 * 2)];
+  unsigned char *failuresBytes = frame + 1; /* also progress address */
+  unsigned short crc;
+  unsigned short length;
+  unsigned int offset;
+  unsigned long address;
+  unsigned char chunk[SEND_CHUNK_SIZE];
+
+  if (RamSize) {
+    ramBanks = GetRAMBanks();
+    TestBankSize = GetMaxAddressRAM() - 0xA000UL;
+    TestMask = ((CartridgeType == 5) || (CartridgeType == 6)) ? 0x0F : 0xFF; /* MBC2 RAM is 4 bits */
+    TestFailures = 0;
+
+    ControlPinsHigh();
+
+    // some MBC2 fix apparently needed
+    ReadByte(0x0134, BUS_DELAY_DEFAULT);
+
+    // some MBC1 fix apparently needed, to set RAM mode
+    if (CartridgeType <= 4) WriteByte(0x6000, 1);
+
+    EnableRAM();
+    SwitchRAMBank(0);
+    TestBank = 0;
+
+    TestDataBus();
+    TestAddressBus((unsigned long)ramBanks * TestBankSize);
+
+    for (bank = 0; bank < ramBanks; bank++) {
+      for (offset = 0; offset < TestBankSize; offset += TEST_CHUNK_SIZE) {
+        address = ((unsigned long)bank * TestBankSize) + offset;
+        length = ((TestBankSize - offset) > TEST_CHUNK_SIZE) ? TEST_CHUNK_SIZE : (TestBankSize - offset);
+
+        /* also keeps the host from timing out */
+        frame[0] = TEST_PROGRESS;
+        LongToArray(failuresBytes, address);
+        Serial.write(0x10);
+        Serial.write(0x02);
+        SendPacketSize(5);
+        Serial.write(frame, 5);
+
+        TestMarchChunk(address, length);
+      }
+    }
+  }
+
+  /* Send: failures + CRC16 of every bank as it is now (masked like the test), host compares with its backup */
+  frame[0] = TEST_DONE;
+  LongToArray(failuresBytes, TestFailures);
+  for (bank = 0; bank < ramBanks; bank++) {
+    SwitchRAMBank(bank);
+    crc = 0;
+    for (offset = 0; offset < TestBankSize; offset += SEND_CHUNK_SIZE) {
+      length = ((TestBankSize - offset) > SEND_CHUNK_SIZE) ? SEND_CHUNK_SIZE : (TestBankSize - offset);
+      ReadBlock(0xA000 + offset, chunk, length, BUS_DELAY_DEFAULT);
+      for (i = 0; i < length; i++) crc = _crc_xmodem_update(crc, chunk[i] & TestMask);
+    }
+    frame[5 + (bank * 2)] = (crc >> 8) & 0xFF;
+    frame[6 + (bank * 2)] = crc & 0xFF;
+  }
+
+  if (RamSize) {
+    DisableRAM();
+    ControlPinsLow();
+  }
+
+  Serial.write(0x10);
+  Serial.write(0x02);
+  SendPacketSize(5 + (ramBanks * 2));
+  Serial.write(frame, 5 + (ramBanks * 2));
 }
 
 ///////////////////////////////////////////////////////////
@@ -277,7 +1147,6 @@ void ReadSendRAM()
 {
   unsigned char bank;
   unsigned char ramBanks;
-  unsigned short i;
   unsigned long ramAddress;
   unsigned long ramMaxAddress;
   unsigned char sendChunk[SEND_CHUNK_SIZE];
@@ -296,7 +1165,7 @@ void ReadSendRAM()
   ControlPinsHigh();
 
   // some MBC2 fix apparently needed
-  ReadByte(0x0134);
+  ReadByte(0x0134, BUS_DELAY_DEFAULT);
 
   // some MBC1 fix apparently needed, to set RAM mode
   if (CartridgeType <= 4) WriteByte(0x6000, 1);
@@ -307,9 +1176,7 @@ void ReadSendRAM()
     ramAddress = 0xA000;
     SwitchRAMBank(bank);
     while (ramAddress < ramMaxAddress) {
-      for (i = 0; i < SEND_CHUNK_SIZE; i++) {
-        sendChunk[i] = ReadByte(ramAddress + i);
-      }
+      ReadBlock(ramAddress, sendChunk, SEND_CHUNK_SIZE, BUS_DELAY_DEFAULT);
       Serial.write(sendChunk, SEND_CHUNK_SIZE);
       ramAddress += SEND_CHUNK_SIZE;
     }
@@ -336,7 +1203,7 @@ void RecvWriteRAM()
   ControlPinsHigh();
 
   // some MBC2 fix apparently needed
-  ReadByte(0x0134);
+  ReadByte(0x0134, BUS_DELAY_DEFAULT);
 
   // some MBC1 fix apparently needed, to set RAM mode
   if (CartridgeType <= 4) WriteByte(0x6000, 1);
@@ -352,6 +1219,8 @@ void RecvWriteRAM()
       data = Serial.read();
       WriteByteRAM(ramAddress, data);
       ramAddress++;
+      /* chunk consumed, host may send the next one */
+      if ((ramAddress % RECV_CHUNK_SIZE) == 0) SendAck(WRITE_RAM_COMMAND);
     }
   }
 
@@ -360,20 +1229,219 @@ void RecvWriteRAM()
   ControlPinsLow();
 }
 
+///////////////////////////////////////////////////////////
+unsigned char *FlashRecvBlock;
+unsigned int FlashRecvCount;
+
+///////////////////////////////////////////////////////////
+void FlashDrainSerial()
+{
+  /* keep receiving the next block while the chip is busy */
+  while ((Serial.available() > 0) && (FlashRecvCount < FLASH_BLOCK_SIZE)) {
+    FlashRecvBlock[FlashRecvCount++] = Serial.read();
+  }
+}
+
+///////////////////////////////////////////////////////////
+/* erase/program/poll shared with the host emulator */
+#define FLASH_WRITE(A, D)     WriteByte(A, D)
+#define FLASH_READ(A)         ReadByte(A, BUS_DELAY_DEFAULT)
+#define FLASH_MILLIS()        millis()
+#define FLASH_BUSY_POLL()     FlashDrainSerial()
+#define FLASH_CRC16(C, D)     _crc_xmodem_update(C, D)
+#include "flash-rom.h"
+
+///////////////////////////////////////////////////////////
+unsigned char FlashRecvBlockRest()
+{
+  int c;
+  while (FlashRecvCount < FLASH_BLOCK_SIZE) {
+    if ((c = RecvByte()) < 0) return 1;
+    FlashRecvBlock[FlashRecvCount++] = c;
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////
+void RecvFlashROM()
+{
+  int c;
+  unsigned char i;
+  unsigned char type;
+  unsigned char error;
+  unsigned char current;
+  unsigned char params[5];
+  unsigned char *sizeBytes;
+  unsigned long address;
+  unsigned long imageSize;
+  unsigned short bank;
+  unsigned short crc;
+
+  /* Need: TYPE + SIZE(4) */
+  for (i = 0; i < sizeof(params); i++) {
+    if ((c = RecvByte()) < 0) {
+      SendNak(FLASH_ERR_PARAMS);
+      return;
+    }
+    params[i] = c;
+  }
+  type = params[0];
+  sizeBytes = params + 1;
+  imageSize = LongFromArray(sizeBytes);
+  if (FlashCheckParams(type, imageSize)) {
+    SendNak(FLASH_ERR_PARAMS);
+    return;
+  }
+
+  ControlPinsHigh();
+
+  /* the sector map comes from the chip, nothing is erased on a chip we don't know */
+  if (FlashIdentify(type, imageSize)) {
+    ControlPinsLow();
+    SendNak(FLASH_ERR_CHIP);
+    return;
+  }
+  SendAck(FLASH_ROM_COMMAND);
+
+  /* double buffered: block N is acknowledged as soon as it is received,
+   * so the host streams block N+1 while block N is being programmed */
+  error = 0;
+  current = 0;
+  FlashRecvBlock = Scratch.FlashBlocks[current];
+  FlashRecvCount = 0;
+  for (address = 0; address < imageSize; address += FLASH_BLOCK_SIZE) {
+    if (FlashRecvBlockRest()) {
+      error = FLASH_ERR_RECV;
+      break;
+    }
+    if ((address + FLASH_BLOCK_SIZE) < imageSize) SendAck(FLASH_ROM_COMMAND);
+    FlashRecvBlock = Scratch.FlashBlocks[current ^ 1];
+    FlashRecvCount = 0;
+
+    error = FlashWriteBlock(type, address, Scratch.FlashBlocks[current]);
+    if (error) break;
+    current ^= 1;
+  }
+
+  /* back to read array mode */
+  FlashReadArray(type);
+
+  if (error) {
+    ControlPinsLow();
+    SendNak(error);
+    Serial.flush();
+    while (RecvByte() >= 0); /* discard what the host already sent */
+    return;
+  }
+  SendAck(FLASH_ROM_COMMAND);
+
+  /* verify: CRC16 of every bank read back */
+  Serial.write(0x10);
+  Serial.write(0x02);
+  SendPacketSize((imageSize / 0x4000LU) * 2);
+  for (bank = 0; bank < (imageSize / 0x4000LU); bank++) {
+    crc = FlashBankCRC(bank);
+    Serial.write((crc >> 8) & 0xFF);
+    Serial.write(crc & 0xFF);
+  }
+
+  ControlPinsLow();
+}
+
 ///////////////////////////////////////////////////////////
 void SendSizeRAM()
 {
   Serial.write(0x10);
   Serial.write(0x02);
   SendPacketSize(4);
-  if (RamSize == 0) {
-    SendPacketSize(0);
+  SendPacketSize(GetRAMSizeBytes());
+}
+
+///////////////////////////////////////////////////////////
+unsigned short CalibrationCRC(unsigned char delay)
+{
+  unsigned int i;
+  unsigned char j;
+  unsigned short crc = 0;
+  unsigned char chunk[SEND_CHUNK_SIZE];
+
+  /* first bank, header included */
+  for (i = 0; i < 0x4000; i += SEND_CHUNK_SIZE) {
+    ReadBlock(i, chunk, SEND_CHUNK_SIZE, delay);
+    for (j = 0; j < SEND_CHUNK_SIZE; j++) {
+      crc = _crc_xmodem_update(crc, chunk[j]);
+    }
+  }
+  return crc;
+}
+
+///////////////////////////////////////////////////////////
+void Calibrate()
+{
+  unsigned char pass;
+  unsigned char delay;
+  unsigned char stable;
+  unsigned char fastest;
+  unsigned short reference;
+  unsigned char reply[3];
+
+  ControlPinsHigh();
+
+  /* reference with the slowest profile, it has to be reproducible */
+  reference = CalibrationCRC(BUS_DELAY_MAX);
+  stable = ValidateChecksum(BUS_DELAY_MAX) && (CalibrationCRC(BUS_DELAY_MAX) == reference);
+
+  /* decrease until reads stop matching */
+  fastest = BUS_DELAY_MAX;
+  for (delay = BUS_DELAY_MAX; stable && (delay-- > 0);) {
+    for (pass = 0; pass < CALIBRATE_PASSES; pass++) {
+      if (!ValidateChecksum(delay) || (CalibrationCRC(delay) != reference)) break;
+    }
+    if (pass < CALIBRATE_PASSES) break;
+    fastest = delay;
+  }
+
+  if (stable) {
+    BusDelay = ((fastest + BUS_DELAY_MARGIN) > BUS_DELAY_MAX) ? BUS_DELAY_MAX : (fastest + BUS_DELAY_MARGIN);
+    CalibratedCart[0] = ReadByte(0x014D, BUS_DELAY_DEFAULT);
+    CalibratedCart[1] = ReadByte(0x014E, BUS_DELAY_DEFAULT);
+    CalibratedCart[2] = ReadByte(0x014F, BUS_DELAY_DEFAULT);
   }
   else {
-    unsigned char ramBanks = GetRAMBanks();
-    unsigned long ramMaxAddress = GetMaxAddressRAM();
-    SendPacketSize(ramBanks * (ramMaxAddress - 0xA000UL));
+    BusDelay = BUS_DELAY_DEFAULT;
   }
+
+  ControlPinsLow();
+
+  /* Send: profile in use + fastest matching profile + stable */
+  reply[0] = BusDelay;
+  reply[1] = fastest;
+  reply[2] = stable;
+  Serial.write(0x10);
+  Serial.write(0x02);
+  SendPacketSize(sizeof(reply));
+  Serial.write(reply, sizeof(reply));
+}
+
+///////////////////////////////////////////////////////////
+void SetBusDelay()
+{
+  int c;
+
+  /* Need: PROFILE */
+  if (((c = RecvByte()) < 0) || (c > BUS_DELAY_MAX)) {
+    SendNak(SET_BUS_DELAY_COMMAND);
+    return;
+  }
+  BusDelay = c;
+
+  ControlPinsHigh();
+  CalibratedCart[0] = ReadByte(0x014D, BUS_DELAY_DEFAULT);
+  CalibratedCart[1] = ReadByte(0x014E, BUS_DELAY_DEFAULT);
+  CalibratedCart[2] = ReadByte(0x014F, BUS_DELAY_DEFAULT);
+  ControlPinsLow();
+
+  SendAck(SET_BUS_DELAY_COMMAND);
 }
 
 ///////////////////////////////////////////////////////////
@@ -391,65 +1459,113 @@ void setup()
   Serial.begin(SERIAL_BAUDRATE);
 
   ResetVariables();
+
+  /* boot banner, host waits for it instead of a fixed delay */
+  Serial.write(0x10);
+  Serial.write(0x02);
+  SendPacketSize(4);
+  Serial.write("GBx", 3);
+  Serial.write(PROTOCOL_VERSION);
 }
 
 ///////////////////////////////////////////////////////////
 void loop()
 {
-  unsigned char HasDLE = 0;
-  unsigned char HasSTX = 0;
+  int c;
+  unsigned char i;
   unsigned char command = 0;
+  unsigned char packetSize[4];
 
-  while (Serial.available() <= 0) {
-    _delay_ms(250);
-  }
+  if (Serial.available() <= 0) return;
 
   /* Need: DLE + STX + SIZE(4) + CMD */
-  do {
-    HasDLE = (Serial.read() == 0x10);
-  } while (!HasDLE && Serial.available());
-  if (/*HasDLE && */Serial.available()) HasSTX = (Serial.read() == 0x02);
-  if (HasDLE && HasSTX && (Serial.available() == 5)) {
-    long cmdSize;
-    unsigned char packetSize[4];
-    packetSize[0] = Serial.read();
-    packetSize[1] = Serial.read();
-    packetSize[2] = Serial.read();
-    packetSize[3] = Serial.read();
-    cmdSize = GetLongFromCHAR(packetSize);
-    if (cmdSize == 1) command = Serial.read();
-  }
-  else {
-    unsigned char BAD_CMD[6] = { 0x10, 0x02, 0x00, 0x00, 0x00, 0x00 };
-    while (Serial.available()) Serial.read(); /* discard */
-    Serial.write(BAD_CMD, 6);
+  if (Serial.read() != 0x10) return;
+  c = RecvByte();
+  if (c != 0x02) goto L_BAD_CMD;
+  for (i = 0; i < 4; i++) {
+    if ((c = RecvByte()) < 0) goto L_BAD_CMD;
+    packetSize[i] = c;
   }
+  if (LongFromArray(packetSize) != 1) goto L_BAD_CMD;
+  if ((c = RecvByte()) < 0) goto L_BAD_CMD;
+  command = c;
 
   /* Process */
   switch (command) {
     case READ_HEADER_COMMAND:
+      SendAck(command);
       ResetVariables();
       ReadSendHeader();
       break;
     case READ_ROM_COMMAND:
       /* We need: CartridgeType + RomSize */
+      SendAck(command);
       ReadSendROM();
       break;
+    case READ_ROM_MAP_COMMAND:
+      /* We need: CartridgeType + RomSize */
+      SendAck(command);
+      ReadSendROMMap();
+      break;
+    case READ_RANGE_COMMAND:
+      /* We need: CartridgeType + RomSize + RamSize */
+      SendAck(command);
+      ReadSendRange();
+      break;
     case READ_RAM_COMMAND:
       /* We need: CartridgeType + RamSize */
+      SendAck(command);
       ReadSendRAM();
       break;
     case WRITE_RAM_COMMAND:
       /* We need: CartridgeType + RamSize */
+      SendAck(command);
       RecvWriteRAM();
       break;
+    case INFO_COMMAND:
+      SendAck(command);
+      ResetVariables();
+      ReadSendInfo();
+      break;
+    case FLASH_ROM_COMMAND:
+      SendAck(command);
+      RecvFlashROM();
+      break;
+    case CALIBRATE_COMMAND:
+      SendAck(command);
+      Calibrate();
+      break;
+    case SET_BUS_DELAY_COMMAND:
+      SendAck(command);
+      SetBusDelay();
+      break;
+    case WATCH_RAM_COMMAND:
+      /* We need: CartridgeType + RamSize */
+      SendAck(command);
+      WatchRAM();
+      break;
+    case TEST_RAM_COMMAND:
+      /* We need: CartridgeType + RamSize */
+      SendAck(command);
+      TestRAM();
+      break;
     case GET_RAM_SIZE:
       /* We need: CartridgeType */
+      SendAck(command);
       SendSizeRAM();
       break;
     default:
+      SendNak(command);
       break;
   }
 
   Serial.flush();
+  return;
+
+L_BAD_CMD:
+  {
+    unsigned char BAD_CMD[6] = { 0x10, 0x02, 0x00, 0x00, 0x00, 0x00 };
+    while (Serial.available()) Serial.read(); /* discard */
+    Serial.write(BAD_CMD, 6);
+  }
 }
@@ -0,0 +1,335 @@
+///////////////////////////////////////////////////////////
+/// Flash cartridge programming
+// Shared by the firmware and the host emulator (gbx-reader-writer --bench),
+// so the bench runs the same erase/program/poll code as the Arduino.
+// The includer provides the bus before including this file a second time:
+//   FLASH_WRITE(A, D)   write cycle on the cartridge bus
+//   FLASH_READ(A)       read cycle on the cartridge bus
+//   FLASH_MILLIS()      milliseconds clock
+//   FLASH_BUSY_POLL()   called while the chip is busy, receives the next block
+//   FLASH_CRC16(C, D)   CRC16 XMODEM update
+///////////////////////////////////////////////////////////
+#ifndef FLASH_ROM_H
+#define FLASH_ROM_H
+
+/* FLASH_ROM_COMMAND command sets, chosen by host */
+#define FLASH_AMD             0x00
+#define FLASH_AMD_BUFFERED    0x01
+#define FLASH_INTEL           0x02
+#define FLASH_INTEL_BUFFERED  0x03
+
+/* FLASH_ROM_COMMAND NAK codes */
+#define FLASH_ERR_PARAMS      0x01
+#define FLASH_ERR_RECV        0x02
+#define FLASH_ERR_ERASE       0x03
+#define FLASH_ERR_PROGRAM     0x04
+#define FLASH_ERR_CHIP        0x05 /* no CFI answer, other command set or too small */
+
+#define FLASH_BLOCK_SIZE      ( 512       ) /* host block, ACKed one by one */
+#define FLASH_BUFFER_SIZE     ( 32        ) /* write buffer of buffered programming */
+#define FLASH_MAX_REGIONS     ( 4         ) /* CFI erase block regions */
+#define FLASH_TIMEOUT         ( 15000     ) /* milliseconds, worst sector erase in datasheets */
+
+#endif /* FLASH_ROM_H */
+
+#if defined(FLASH_WRITE) && !defined(FLASH_ROM_CODE)
+#define FLASH_ROM_CODE
+
+/* chip found by FlashIdentify */
+typedef struct {
+  unsigned short unlock1;                        /* AMD unlock addresses as wired on the cartridge */
+  unsigned short unlock2;
+  unsigned char swapData;                        /* D0/D1 swapped between cartridge and chip */
+  unsigned char regions;
+  unsigned long blocks[FLASH_MAX_REGIONS];       /* erase blocks of each region, lowest address first */
+  unsigned long blockSize[FLASH_MAX_REGIONS];
+} FlashChipInfo;
+
+static FlashChipInfo FlashChip;
+
+///////////////////////////////////////////////////////////
+static unsigned int FlashAddress(unsigned int address, unsigned char swapAddress)
+{
+  if (!swapAddress) return address;
+  return (address & ~0x03) | ((address & 0x01) << 1) | ((address >> 1) & 0x01);
+}
+
+///////////////////////////////////////////////////////////
+static unsigned char FlashData(unsigned char data)
+{
+  /* commands and status go through the cartridge wiring, array data reads back as written */
+  if (!FlashChip.swapData) return data;
+  return (data & ~0x03) | ((data & 0x01) << 1) | ((data >> 1) & 0x01);
+}
+
+///////////////////////////////////////////////////////////
+static void FlashCommand(unsigned int address, unsigned char command)
+{
+  FLASH_WRITE(address, FlashData(command));
+}
+
+///////////////////////////////////////////////////////////
+static unsigned short FlashQuery(unsigned int offset, unsigned char stride, unsigned char swapAddress)
+{
+  /* CFI words are little endian, one byte per query address */
+  return FlashData(FLASH_READ(FlashAddress(offset * stride, swapAddress))) |
+         ((unsigned int)FlashData(FLASH_READ(FlashAddress((offset + 1) * stride, swapAddress))) << 8);
+}
+
+///////////////////////////////////////////////////////////
+static unsigned char FlashIdentify(unsigned char type, unsigned long imageSize)
+{
+  unsigned char i;
+  unsigned char wiring;
+  unsigned char stride = 1;
+  unsigned char swapAddress = 0;
+  unsigned short commandSet;
+  unsigned short primary;
+  unsigned long bufferSize;
+  unsigned long chipSize;
+  unsigned long total;
+
+  /* CFI query of x8 chips and of x16 chips in byte mode, with A0/A1 and D0/D1 straight or swapped */
+  for (wiring = 0; wiring < 8; wiring++) {
+    stride = (wiring & 0x01) ? 2 : 1;
+    swapAddress = (wiring >> 1) & 0x01;
+    FlashChip.swapData = (wiring >> 2) & 0x01;
+    FlashCommand(0x0000, 0xF0); /* AMD reset */
+    FlashCommand(0x0000, 0xFF); /* Intel read array */
+    FlashCommand(FlashAddress(0x55 * stride, swapAddress), 0x98);
+    if ((FlashQuery(0x10, stride, swapAddress) == ('Q' | ('R' << 8))) && ((FlashQuery(0x12, stride, swapAddress) & 0xFF) == 'Y')) break;
+  }
+  if (wiring == 8) {
+    FlashChip.swapData = 0;
+    FlashCommand(0x0000, 0xF0);
+    FlashCommand(0x0000, 0xFF);
+    return 1;
+  }
+
+  commandSet = FlashQuery(0x13, stride, swapAddress);
+  primary = FlashQuery(0x15, stride, swapAddress);
+  chipSize = 1LU << (FlashQuery(0x27, stride, swapAddress) & 0x1F);
+  bufferSize = FlashQuery(0x2A, stride, swapAddress);
+  bufferSize = bufferSize ? (1LU << (bufferSize & 0x1F)) : 0;
+  FlashChip.regions = FlashQuery(0x2C, stride, swapAddress) & 0xFF;
+  total = 0;
+  for (i = 0; (i < FlashChip.regions) && (i < FLASH_MAX_REGIONS); i++) {
+    FlashChip.blocks[i] = (unsigned long)FlashQuery(0x2D + (4 * i), stride, swapAddress) + 1;
+    FlashChip.blockSize[i] = (unsigned long)FlashQuery(0x2F + (4 * i), stride, swapAddress) * 256;
+    total += FlashChip.blocks[i] * FlashChip.blockSize[i];
+  }
+
+  /* AMD top boot parts list their regions bottom first, the boot flag tells (same fixup as Linux) */
+  if ((commandSet == 0x0002) && (FlashChip.regions > 1) && (FlashChip.regions <= FLASH_MAX_REGIONS) &&
+      (primary < 0x100) && ((FlashQuery(primary + 0x0F, stride, swapAddress) & 0xFF) == 0x03)) {
+    for (i = 0; i < (FlashChip.regions / 2); i++) {
+      unsigned long blocks = FlashChip.blocks[i];
+      unsigned long blockSize = FlashChip.blockSize[i];
+      FlashChip.blocks[i] = FlashChip.blocks[FlashChip.regions - 1 - i];
+      FlashChip.blockSize[i] = FlashChip.blockSize[FlashChip.regions - 1 - i];
+      FlashChip.blocks[FlashChip.regions - 1 - i] = blocks;
+      FlashChip.blockSize[FlashChip.regions - 1 - i] = blockSize;
+    }
+  }
+
+  /* leave query mode */
+  FlashCommand(0x0000, 0xF0);
+  FlashCommand(0x0000, 0xFF);
+
+  FlashChip.unlock1 = FlashAddress((stride == 2) ? 0x0AAA : 0x0555, swapAddress);
+  FlashChip.unlock2 = FlashAddress((stride == 2) ? 0x0555 : 0x02AA, swapAddress);
+
+  /* only what the host asked for and what the erase map covers */
+  if ((type <= FLASH_AMD_BUFFERED) ? (commandSet != 0x0002) : ((commandSet != 0x0001) && (commandSet != 0x0003))) return 1;
+  if (((type == FLASH_AMD_BUFFERED) || (type == FLASH_INTEL_BUFFERED)) && (bufferSize < FLASH_BUFFER_SIZE)) return 1;
+  if ((FlashChip.regions == 0) || (FlashChip.regions > FLASH_MAX_REGIONS)) return 1;
+  for (i = 0; i < FlashChip.regions; i++) {
+    if ((FlashChip.blockSize[i] < FLASH_BLOCK_SIZE) || (FlashChip.blockSize[i] % FLASH_BLOCK_SIZE)) return 1;
+  }
+  if ((imageSize > chipSize) || (imageSize > total)) return 1;
+
+  return 0;
+}
+
+///////////////////////////////////////////////////////////
+static unsigned char FlashSectorStart(unsigned long address)
+{
+  unsigned char i;
+  unsigned long base = 0;
+
+  for (i = 0; i < FlashChip.regions; i++) {
+    unsigned long end = base + (FlashChip.blocks[i] * FlashChip.blockSize[i]);
+    if (address < end) return ((address - base) % FlashChip.blockSize[i]) == 0;
+    base = end;
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////
+static unsigned char FlashCheckParams(unsigned char type, unsigned long imageSize)
+{
+  return (type > FLASH_INTEL_BUFFERED) || (imageSize == 0) || (imageSize > 0x800000LU) || (imageSize % 0x4000LU);
+}
+
+///////////////////////////////////////////////////////////
+static unsigned int FlashSelect(unsigned long address)
+{
+  /* MBC5: 9 bits ROM bank, every bank (even 0) mapped at 0x4000 */
+  unsigned short bank = address >> 14;
+  FLASH_WRITE(0x3000, (bank >> 8) & 0x01);
+  FLASH_WRITE(0x2000, bank & 0xFF);
+  return 0x4000 | (address & 0x3FFF);
+}
+
+///////////////////////////////////////////////////////////
+static void FlashUnlockAMD()
+{
+  FlashCommand(FlashChip.unlock1, 0xAA);
+  FlashCommand(FlashChip.unlock2, 0x55);
+}
+
+///////////////////////////////////////////////////////////
+static unsigned char FlashWaitAMD(unsigned int address)
+{
+  unsigned char a;
+  unsigned char b;
+  unsigned long start = FLASH_MILLIS();
+
+  /* DQ6 toggles while busy, DQ5 signals internal timeout */
+  do {
+    FLASH_BUSY_POLL();
+    a = FLASH_READ(address);
+    b = FLASH_READ(address);
+    if (((a ^ b) & 0x40) == 0) return 0;
+    if (b & 0x20) {
+      a = FLASH_READ(address);
+      b = FLASH_READ(address);
+      if (((a ^ b) & 0x40) == 0) return 0;
+      break;
+    }
+  } while ((FLASH_MILLIS() - start) < FLASH_TIMEOUT);
+
+  FlashCommand(0x0000, 0xF0); /* reset */
+  return 1;
+}
+
+///////////////////////////////////////////////////////////
+static unsigned char FlashWaitIntel(unsigned int address)
+{
+  unsigned char status;
+  unsigned long start = FLASH_MILLIS();
+
+  /* SR.7 ready, SR.5 erase, SR.4 program, SR.3 VPP, SR.1 lock errors */
+  do {
+    FLASH_BUSY_POLL();
+    status = FlashData(FLASH_READ(address));
+    if (status & 0x80) {
+      if ((status & 0x3A) == 0) return 0;
+      break;
+    }
+  } while ((FLASH_MILLIS() - start) < FLASH_TIMEOUT);
+
+  FlashCommand(address, 0x50); /* clear status */
+  FlashCommand(address, 0xFF); /* read array */
+  return 1;
+}
+
+///////////////////////////////////////////////////////////
+static unsigned char FlashEraseSector(unsigned char type, unsigned long address)
+{
+  unsigned int sectorAddress = FlashSelect(address);
+
+  if (type <= FLASH_AMD_BUFFERED) {
+    FlashUnlockAMD();
+    FlashCommand(FlashChip.unlock1, 0x80);
+    FlashUnlockAMD();
+    FlashCommand(sectorAddress, 0x30);
+    return FlashWaitAMD(sectorAddress);
+  }
+
+  FlashCommand(sectorAddress, 0x20);
+  FlashCommand(sectorAddress, 0xD0);
+  return FlashWaitIntel(sectorAddress);
+}
+
+///////////////////////////////////////////////////////////
+static unsigned char FlashProgramBlock(unsigned char type, unsigned long address, const unsigned char *data)
+{
+  unsigned int i;
+  unsigned int j;
+  unsigned int blockAddress = FlashSelect(address);
+
+  if (type == FLASH_AMD) {
+    for (i = 0; i < FLASH_BLOCK_SIZE; i++) {
+      if (data[i] == 0xFF) continue; /* already erased */
+      FlashUnlockAMD();
+      FlashCommand(FlashChip.unlock1, 0xA0);
+      FLASH_WRITE(blockAddress + i, data[i]);
+      if (FlashWaitAMD(blockAddress + i)) return 1;
+    }
+  }
+  else if (type == FLASH_AMD_BUFFERED) {
+    for (i = 0; i < FLASH_BLOCK_SIZE; i += FLASH_BUFFER_SIZE) {
+      FlashUnlockAMD();
+      FlashCommand(blockAddress + i, 0x25);
+      FlashCommand(blockAddress + i, FLASH_BUFFER_SIZE - 1);
+      for (j = 0; j < FLASH_BUFFER_SIZE; j++) {
+        FLASH_WRITE(blockAddress + i + j, data[i + j]);
+      }
+      FlashCommand(blockAddress + i, 0x29);
+      if (FlashWaitAMD(blockAddress + i + FLASH_BUFFER_SIZE - 1)) return 1;
+    }
+  }
+  else if (type == FLASH_INTEL) {
+    for (i = 0; i < FLASH_BLOCK_SIZE; i++) {
+      if (data[i] == 0xFF) continue; /* already erased */
+      FlashCommand(blockAddress + i, 0x40);
+      FLASH_WRITE(blockAddress + i, data[i]);
+      if (FlashWaitIntel(blockAddress + i)) return 1;
+    }
+  }
+  else {
+    for (i = 0; i < FLASH_BLOCK_SIZE; i += FLASH_BUFFER_SIZE) {
+      FlashCommand(blockAddress + i, 0xE8);
+      if (FlashWaitIntel(blockAddress + i)) return 1; /* write buffer available */
+      FlashCommand(blockAddress + i, FLASH_BUFFER_SIZE - 1);
+      for (j = 0; j < FLASH_BUFFER_SIZE; j++) {
+        FLASH_WRITE(blockAddress + i + j, data[i + j]);
+      }
+      FlashCommand(blockAddress + i, 0xD0);
+      if (FlashWaitIntel(blockAddress + i)) return 1;
+    }
+  }
+
+  return 0;
+}
+
+///////////////////////////////////////////////////////////
+static unsigned char FlashWriteBlock(unsigned char type, unsigned long address, const unsigned char *data)
+{
+  /* a sector is erased when its first block arrives, returns a NAK code */
+  if (FlashSectorStart(address) && FlashEraseSector(type, address)) return FLASH_ERR_ERASE;
+  if (FlashProgramBlock(type, address, data)) return FLASH_ERR_PROGRAM;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////
+static void FlashReadArray(unsigned char type)
+{
+  FlashCommand(0x0000, (type <= FLASH_AMD_BUFFERED) ? 0xF0 : 0xFF);
+}
+
+///////////////////////////////////////////////////////////
+static unsigned short FlashBankCRC(unsigned short bank)
+{
+  unsigned int address;
+  unsigned short crc = 0;
+
+  FlashSelect((unsigned long)bank << 14);
+  for (address = 0x4000; address <= 0x7FFF; address++) {
+    crc = FLASH_CRC16(crc, FLASH_READ(address));
+  }
+  return crc;
+}
+
+#endif /* FLASH_WRITE && !FLASH_ROM_CODE */
@@ -7,6 +7,8 @@
  */
 #if defined(_WIN32) || defined(_WIN64)
 #define _CRT_SECURE_NO_WARNINGS
+#elif defined(__linux__)
+#define _GNU_SOURCE /* posix_openpt, cfmakeraw */
 #endif /* _WIN32 || _WIN64 */
 
 #include <stdio.h>
@@ -20,12 +22,18 @@
 
 #if defined(_WIN32) || defined(_WIN64)
 #include <windows.h>
+#include <direct.h>
+#include <io.h>
 
 #else
 #include <unistd.h>
 #include <termios.h>
 #include <getopt.h>
 #include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <pthread.h>
 
 #if __APPLE__
 #include <IOKit/serial/ioss.h>
@@ -38,8 +46,16 @@
 ///////////////////////////////////////////////////////////
 #define SERIAL_BAUDRATE   ( 500000 )
 #define SERIAL_TIMEOUT    ( 3      ) /* seconds */
+#define BOOT_TIMEOUT      ( 2000   ) /* milliseconds */
+#define BOOT_PROBE_IDLE   ( 250    ) /* milliseconds of silence before probing a board without auto-reset */
+#define POLL_INTERVAL     ( 10     ) /* milliseconds */
+#define TIMEOUT_MIN       ( 100    ) /* milliseconds, USB latency and scheduling */
+#define TIMEOUT_CHUNKS    ( 8      ) /* silent chunk times before a transfer is stalled */
+#define COMMAND_RETRIES   ( 2      ) /* resends of a command nobody answered */
+#define SEND_WINDOW       ( 2      ) /* chunks in flight, firmware RX buffer is 64 bytes */
 #define SEND_CHUNK_SIZE   ( 32     )
 #define RECV_CHUNK_SIZE   ( 512    )
+#define RECV_CHUNK_MAX    ( 4096   )
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
@@ -47,17 +63,98 @@
 #define READ_ROM_COMMAND      0x02
 #define READ_RAM_COMMAND      0x03
 #define WRITE_RAM_COMMAND     0x04
+#define INFO_COMMAND          0x05
+#define FLASH_ROM_COMMAND     0x06
+#define READ_ROM_MAP_COMMAND  0x07
+#define READ_RANGE_COMMAND    0x08
+#define CALIBRATE_COMMAND     0x09
+#define SET_BUS_DELAY_COMMAND 0x0A
+#define WATCH_RAM_COMMAND     0x0B
+#define TEST_RAM_COMMAND      0x0C
 #define GET_RAM_SIZE          0xF0
 
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+#define ACK                   0x06
+#define NAK                   0x15
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+#define PROTOCOL_VERSION      ( 1 )
+
+/* capabilities bitmap received in INFO_COMMAND reply, 0x0001 and 0x0002 are reserved */
+#define CAP_RANGE_READ        0x0004
+#define CAP_BANK_MAP          0x0008
+#define CAP_BUS_TIMING        0x0010
+#define CAP_RAM_WATCH         0x0020
+#define CAP_RAM_TEST          0x0040
+
+/* READ_ROM_MAP_COMMAND bank frames */
+#define BANK_DATA             0x00
+#define BANK_MIRROR           0x01
+#define BANK_BLANK            0x02
+
+/* bus timing profiles, nops of the firmware read cycle at 16MHz */
+#define BUS_DELAY_MAX         ( 7 )
+#define bus_delay_ns(P)       ( ((P) + 2) * 62.5 )
+
+/* WATCH_RAM_COMMAND frames: TIME(4) + BLOCK(2) + DATA, BLOCK 0xFFFF ends a pass */
+#define WATCH_BLOCK_SIZE      ( 256 ) /* must match firmware */
+#define WATCH_END_OF_PASS     0xFFFF
+#define WATCH_LOG_DIFFS       ( 8   ) /* changed bytes listed per block */
+
+/* TEST_RAM_COMMAND frames, first byte is the type */
+#define TEST_PROGRESS         0x00 /* + ADDRESS(4) */
+#define TEST_FAIL             0x01 /* + TEST + ADDRESS(4) + EXPECTED + ACTUAL */
+#define TEST_DONE             0x02 /* + FAILURES(4) + CRC16 of every bank */
+#define TEST_MAX_FAILURES     ( 32 ) /* failures reported by the firmware, the rest is only counted */
+
+/* READ_RANGE_COMMAND areas */
+#define AREA_ROM              0x00
+#define AREA_RAM              0x01
+
+/* FLASH_ROM_COMMAND constants, shared with the firmware */
+#include "arduino-cartridge-rw/flash-rom.h"
+
+/* INFO_COMMAND reply: header 0x0100-0x014F + ROM size(4) + RAM size(4) + version(1) + capabilities(2) */
+#define INFO_HEADER_START     0x0100
+#define INFO_HEADER_SIZE      0x50
+#define INFO_PACKET_SIZE      ( INFO_HEADER_SIZE + 4 + 4 + 1 + 2 )
+
+#define header_byte(A)        ( cart_info.header[(A) - INFO_HEADER_START] )
+
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
 static int ctrlc = 0;
 static unsigned char verbose = 0;
+static unsigned char assume_yes = 0;
+static unsigned char archive_dumps = 0;
+static unsigned int recv_chunk_size = RECV_CHUNK_SIZE;
+
+/* timeouts follow the baud rate and the gaps seen between chunks */
+static struct {
+  unsigned long baud;
+  unsigned long gap_us;           /* running average of the gaps */
+  unsigned long gap_dev_us;       /* running average of their deviation */
+  unsigned long stalls;
+  unsigned long retries;
+} serial_link = { SERIAL_BAUDRATE, 0, 0, 0, 0 };
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
 static char rom_title[16];
 
+static struct {
+  unsigned char header[INFO_HEADER_SIZE];
+  unsigned long rom_size;
+  unsigned long ram_size;
+  unsigned char protocol;
+  unsigned short capabilities;
+} cart_info;
+
+/* header 0x014D-0x014F of the last calibrated cartridge */
+static unsigned char timing_cart[3];
+
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
 #define print_state_console(S,D)   ( printf("\rState: %ld of %ld (%.1f%%)", D, S, (((double)D / (double)S) * 100)), fflush(stdout) )
@@ -69,17 +166,20 @@ static char rom_title[16];
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
 #if defined(_WIN32) || defined(_WIN64)
-#define wait_ms   Sleep
-
 #define get_time()      ( GetTickCount()                               )
 #define time_valid(S)   ( ((get_time() - S) < (SERIAL_TIMEOUT * 1000)) )
+#define time_within(S,T) ( ((get_time() - S) < (T))                    )
 
-#else
-static void wait_ms(unsigned int in_milliseconds)
+static unsigned long long get_time_us()
 {
-  usleep(in_milliseconds * 1000UL);
+  LARGE_INTEGER freq;
+  LARGE_INTEGER count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return ((count.QuadPart / freq.QuadPart) * 1000000ULL) + (((count.QuadPart % freq.QuadPart) * 1000000ULL) / freq.QuadPart);
 }
 
+#else
 static unsigned long get_time()
 {
   struct timespec ts;
@@ -87,7 +187,15 @@ static unsigned long get_time()
   return (unsigned long)((ts.tv_nsec / 1000000) + (ts.tv_sec * 1000UL));
 }
 
+static unsigned long long get_time_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)((ts.tv_nsec / 1000) + (ts.tv_sec * 1000000ULL));
+}
+
 #define time_valid(S)   ( ((get_time() - S) < (SERIAL_TIMEOUT * 1000)) )
+#define time_within(S,T) ( ((get_time() - S) < (T))                    )
 
 #endif /* _WIN32 || _WIN64 */
 
@@ -139,668 +247,4952 @@ static ssize_t write(HANDLE fd, const void *buf, size_t count)
 
 #define flush_serial(fd)   ( PurgeComm(fd, PURGE_TXABORT | PURGE_RXABORT | PURGE_TXCLEAR | PURGE_RXCLEAR) )
 
+#define make_dir(P)   ( _mkdir(P) )
+
+#define truncate_file(FP, S)   ( _chsize_s(_fileno(FP), S) )
+
+/* ReadFile already blocks until a byte arrives or POLL_INTERVAL expires (see COMMTIMEOUTS) */
+#define wait_readable(fd, ms)   ( 1 )
+
+#define sleep_us(U)   ( Sleep((DWORD)(((U) + 999) / 1000)) )
+
+#define set_dtr(fd, on)   ( EscapeCommFunction(fd, (on) ? SETDTR : CLRDTR) )
+
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+
+#define THREAD_FUNC(F, A)       DWORD WINAPI F(LPVOID A)
+#define THREAD_RETURN           return 0
+#define thread_start(T, F, A)   ( (*(T) = CreateThread(NULL, 0, F, A, 0, NULL)) == NULL )
+#define thread_join(T)          ( WaitForSingleObject(T, INFINITE), CloseHandle(T) )
+#define mutex_init(M)           InitializeCriticalSection(M)
+#define mutex_lock(M)           EnterCriticalSection(M)
+#define mutex_unlock(M)         LeaveCriticalSection(M)
+#define mutex_destroy(M)        DeleteCriticalSection(M)
+#define cond_init(C)            InitializeConditionVariable(C)
+#define cond_wait(C, M)         SleepConditionVariableCS(C, M, INFINITE)
+#define cond_broadcast(C)       WakeAllConditionVariable(C)
+#define cond_destroy(C)
+
+/* worker threads format dates with their own struct tm */
+#define localtime_r(T, TM)      ( (localtime_s(TM, T) == 0) ? (TM) : NULL )
+
 #else
 #define HANDLE   int
 
 #define flush_serial(fd)   ( tcflush(fd, TCIOFLUSH) )
 
+#define make_dir(P)   ( mkdir(P, 0755) )
+
+#define truncate_file(FP, S)   ( ftruncate(fileno(FP), S) )
+
+#define sleep_us(U)   ( usleep(U) )
+
+static int set_dtr(HANDLE fd, int on)
+{
+  int bits = TIOCM_DTR;
+  return ioctl(fd, on ? TIOCMBIS : TIOCMBIC, &bits);
+}
+
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+
+#define THREAD_FUNC(F, A)       void *F(void *A)
+#define THREAD_RETURN           return NULL
+#define thread_start(T, F, A)   ( pthread_create(T, NULL, F, A) != 0 )
+#define thread_join(T)          ( pthread_join(T, NULL) )
+#define mutex_init(M)           pthread_mutex_init(M, NULL)
+#define mutex_lock(M)           pthread_mutex_lock(M)
+#define mutex_unlock(M)         pthread_mutex_unlock(M)
+#define mutex_destroy(M)        pthread_mutex_destroy(M)
+#define cond_init(C)            pthread_cond_init(C, NULL)
+#define cond_wait(C, M)         pthread_cond_wait(C, M)
+#define cond_broadcast(C)       pthread_cond_broadcast(C)
+#define cond_destroy(C)         pthread_cond_destroy(C)
+
+static int wait_readable(HANDLE fd, unsigned int in_milliseconds)
+{
+  fd_set rfds;
+  struct timeval tv;
+  FD_ZERO(&rfds);
+  FD_SET(fd, &rfds);
+  tv.tv_sec = in_milliseconds / 1000;
+  tv.tv_usec = (in_milliseconds % 1000) * 1000;
+  return select(fd + 1, &rfds, NULL, NULL, &tv);
+}
+
 #endif /* _WIN32 || _WIN64 */
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static unsigned char get_file_size(const char *path, ssize_t *out_size)
+/* session trace: MAGIC + VERSION, then per serial read/write TYPE + DELTA + LEN + DATA,
+ * DELTA is microseconds since the previous record, DELTA and LEN are LEB128 varints */
+#define TRACE_MAGIC           "GBXTRC"
+#define TRACE_VERSION         ( 1 )
+#define TRACE_READ            'R'
+#define TRACE_WRITE           'W'
+
+typedef struct {
+  unsigned char type;
+  unsigned long long delta;
+  unsigned long long done_at; /* 0 until the host consumed it */
+  size_t len;
+  unsigned char *data;
+} trace_entry;
+
+/* reads and writes are consumed by two cursors, a read is delivered once
+ * the record before it is done plus its recorded delay (scaled by speed) */
+typedef struct {
+  unsigned char active;
+  unsigned char finished;
+  double speed; /* 0: as fast as possible */
+  trace_entry *entries;
+  unsigned long count;
+  unsigned long read_next;
+  size_t read_pos;
+  unsigned long write_next;
+  size_t write_pos;
+  unsigned long mismatches;
+  unsigned long long bytes_read;
+  unsigned long long bytes_written;
+  unsigned long long start;
+} replay_state;
+
+static FILE *trace_fp = NULL;
+static unsigned long long trace_last = 0;
+static replay_state replay;
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void trace_put_varint(FILE *fp, unsigned long long v)
 {
-  struct stat tmp;
-  *out_size = 0;
-  if (stat(path, &tmp) != 0) return 1;
-  *out_size = (ssize_t)tmp.st_size;
+  do {
+    unsigned char c = v & 0x7F;
+    v >>= 7;
+    if (v) c |= 0x80;
+    fputc(c, fp);
+  } while (v);
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char trace_get_varint(FILE *fp, unsigned long long *v)
+{
+  int c;
+  int shift = 0;
+
+  *v = 0;
+  do {
+    if (((c = fgetc(fp)) == EOF) || (shift > 63)) return 1;
+    *v |= (unsigned long long)(c & 0x7F) << shift;
+    shift += 7;
+  } while (c & 0x80);
+
   return 0;
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static void print_packet(const unsigned char *packet, long packet_size)
+static unsigned char trace_open(const char *path)
 {
-  long i;
-  for (i = 0; i < packet_size; i++) {
-    printf("%02X ", packet[i]);
+  trace_fp = fopen(path, "wb");
+  if (!trace_fp) {
+    printf("Error creating %s: %s\n", path, strerror(errno));
+    return 1;
   }
-  printf("\n");
+  fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace_fp);
+  fputc(TRACE_VERSION, trace_fp);
+  trace_last = get_time_us();
+  return 0;
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static void print_usage(const char *program_name)
+static void trace_record(unsigned char type, const void *buf, size_t len)
 {
-#if defined(_WIN32) || defined(_WIN64)
-  printf("\nUsage: %s <port> [OPTIONS...]\n", program_name);
-  printf("\n");
-  printf("  -v            print debug.\n");
-  printf("\nExample:\n");
-  printf("  %s COM9\n", program_name);
-#else
-  printf("\nUsage: %s -p <port> [OPTIONS...]\n", program_name);
-  printf("\n");
-  printf("  -v, --verbose            print debug.\n");
-  printf("  -h, --help               print this screen.\n");
-  printf("\nExample:\n");
-  printf("  %s -p /dev/ttyACM0\n", program_name);
-#endif /* _WIN32 || _WIN64 */
-  printf("\n");
+  unsigned long long now = get_time_us();
+
+  fputc(type, trace_fp);
+  trace_put_varint(trace_fp, now - trace_last);
+  trace_put_varint(trace_fp, len);
+  fwrite(buf, 1, len, trace_fp);
+  trace_last = now;
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static const char* print_cartridge_string(unsigned char cartridge_type)
+static unsigned char replay_open(const char *path, double speed)
 {
-  switch (cartridge_type) {
-    case 0x00:   return("00h - ROM ONLY");
-    case 0x01:   return("01h - MBC1");
-    case 0x02:   return("02h - MBC1+RAM");
-    case 0x03:   return("03h - MBC1+RAM+BATTERY");
-    case 0x05:   return("05h - MBC2");
-    case 0x06:   return("06h - MBC2+BATTERY");
-    case 0x08:   return("08h - ROM+RAM");
-    case 0x09:   return("09h - ROM+RAM+BATTERY");
-    case 0x0B:   return("08h - MMM01");
-    case 0x0C:   return("0Ch - MMM01+RAM");
-    case 0x0D:   return("0Dh - MMM01+RAM+BATTERY");
-    case 0x0F:   return("0Fh - MBC3+TIMER+BATTERY");
-    case 0x10:   return("10h - MBC3+TIMER+RAM+BATTERY");
-    case 0x11:   return("11h - MBC3");
-    case 0x12:   return("12h - MBC3+RAM");
-    case 0x13:   return("13h - MBC3+RAM+BATTERY");
-    case 0x19:   return("19h - MBC5");
-    case 0x1A:   return("1Ah - MBC5+RAM");
-    case 0x1B:   return("1Bh - MBC5+RAM+BATTERY");
-    case 0x1C:   return("1Ch - MBC5+RUMBLE");
-    case 0x1D:   return("1Dh - MBC5+RUMBLE+RAM");
-    case 0x1E:   return("1Eh - MBC5+RUMBLE+RAM+BATTERY");
-    case 0x20:   return("20h - MBC6");
-    case 0x22:   return("22h - MBC7+SENSOR+RUMBLE+RAM+BATTERY");
-    case 0xFC:   return("FCh - POCKET CAMERA");
-    case 0xFD:   return("FDh - BANDAI TAMA5");
-    case 0xFE:   return("FEh - HuC3");
-    case 0xFF:   return("FFh - HuC1+RAM+BATTERY");
-    default:     break;
+  int type;
+  FILE *fp;
+  char magic[sizeof(TRACE_MAGIC)];
+  unsigned long capacity = 0;
+  unsigned long long len;
+  trace_entry *e;
+
+  fp = fopen(path, "rb");
+  if (!fp) {
+    printf("Error openning %s: %s\n", path, strerror(errno));
+    return 1;
   }
-  return("UNKNOW");
+  if ((fread(magic, 1, strlen(TRACE_MAGIC), fp) != strlen(TRACE_MAGIC)) || memcmp(magic, TRACE_MAGIC, strlen(TRACE_MAGIC)) ||
+      (fgetc(fp) != TRACE_VERSION)) {
+    printf("%s is not a session trace\n", path);
+    fclose(fp);
+    return 2;
+  }
+
+  memset(&replay, 0, sizeof(replay));
+  while ((type = fgetc(fp)) != EOF) {
+    if (replay.count == capacity) {
+      capacity = capacity ? (capacity * 2) : 1024;
+      replay.entries = (trace_entry *)realloc(replay.entries, capacity * sizeof(trace_entry)); // assume success
+    }
+    e = &replay.entries[replay.count];
+    memset(e, 0, sizeof(trace_entry));
+    if (((type != TRACE_READ) && (type != TRACE_WRITE)) || trace_get_varint(fp, &e->delta) || trace_get_varint(fp, &len)) break;
+    e->type = type;
+    e->len = len;
+    e->data = (unsigned char *)malloc(len ? len : 1); // assume success
+    if (fread(e->data, 1, len, fp) != len) {
+      free(e->data);
+      break;
+    }
+    replay.count++;
+  }
+  if (type != EOF) printf("Trace %s is truncated, replaying %lu records\n", path, replay.count);
+  fclose(fp);
+
+  replay.active = 1;
+  replay.speed = speed;
+  replay.start = get_time_us();
+  return 0;
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static const char* print_rom_size(unsigned char rom_size)
+static void replay_close()
 {
-  switch (rom_size) {
-    case 0x00:   return("00h - 32KByte(no ROM banking)");
-    case 0x01:   return("01h - 64KByte(4 banks)");
-    case 0x02:   return("02h - 128KByte(8 banks)");
-    case 0x03:   return("03h - 256KByte(16 banks)");
-    case 0x04:   return("04h - 512KByte(32 banks)");
-    case 0x05:   return("05h - 1MByte(64 banks) => only 63 banks used by MBC1");
-    case 0x06:   return("06h - 2MByte(128 banks) => only 125 banks used by MBC1");
-    case 0x07:   return("07h - 4MByte(256 banks)");
-    case 0x08:   return("08h - 8MByte(512 banks)");
-    case 0x52:   return("52h - 1.1MByte(72 banks)");
-    case 0x53:   return("53h - 1.2MByte(80 banks)");
-    case 0x54:   return("54h - 1.5MByte(96 banks)");
-    default:     break;
-  }
-  return("UNKNOW");
+  unsigned long i;
+  for (i = 0; i < replay.count; i++) free(replay.entries[i].data);
+  free(replay.entries);
+  memset(&replay, 0, sizeof(replay));
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static const char* print_ram_size(unsigned char ram_size)
+static void replay_check_end()
 {
-  switch (ram_size) {
-    case 0x00:   return("00h - None");
-    case 0x01:   return("01h - 2 KBytes");
-    case 0x02:   return("02h - 8 Kbytes");
-    case 0x03:   return("03h - 32 KBytes(4 banks of 8KBytes each)");
-    case 0x04:   return("04h - 128 KBytes(16 banks of 8KBytes each)");
-    case 0x05:   return("05h - 64 KBytes(8 banks of 8KBytes each)");
-    default:     break;
-  }
-  return("UNKNOW");
+  while ((replay.write_next < replay.count) && (replay.entries[replay.write_next].type != TRACE_WRITE)) replay.write_next++;
+  while ((replay.read_next < replay.count) && (replay.entries[replay.read_next].type != TRACE_READ)) replay.read_next++;
+  if (replay.finished || (replay.read_next < replay.count) || (replay.write_next < replay.count)) return;
+  replay.finished = 1;
+  printf("\nReplay finished: %lu records, %llu bytes read, %llu bytes written, %lu mismatched writes, %.2f ms\n",
+         replay.count, replay.bytes_read, replay.bytes_written, replay.mismatches, (get_time_us() - replay.start) / 1000.0);
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static unsigned char send_packet_routine(HANDLE fd, unsigned char cmd)
+static unsigned long long replay_read_due()
 {
-  int i;
-  unsigned char tx_packet[7];
-
-  if (verbose) printf("send_packet_routine\n");
+  unsigned long long ready;
+  const trace_entry *e;
 
-  i = 0;
-  tx_packet[i++] = 0x10;
-  tx_packet[i++] = 0x02;
-  tx_packet[i++] = 0x00;
-  tx_packet[i++] = 0x00;
-  tx_packet[i++] = 0x00;
-  tx_packet[i++] = 0x01;
-  tx_packet[i++] = cmd;
+  replay_check_end();
+  if (replay.read_next >= replay.count) return ~0ULL;
 
-  if (verbose) print_packet(tx_packet, sizeof(tx_packet));
-  if (write(fd, tx_packet, sizeof(tx_packet)) != sizeof(tx_packet)) {
-    printf("Error sending command: %s\n", strerror(errno));
-    return 1;
-  }
+  e = &replay.entries[replay.read_next];
+  if (replay.read_next == 0) ready = replay.start;
+  else ready = replay.entries[replay.read_next - 1].done_at;
+  if (!ready) return ~0ULL; /* a write recorded before it is still pending */
 
-  return 0;
+  if (replay.speed > 0) ready += (unsigned long long)(e->delta / replay.speed);
+  return ready;
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static ssize_t recv_packet_header_size(HANDLE fd)
+static ssize_t replay_read(void *buf, size_t count)
 {
-  ssize_t ret;
-  ssize_t available;
-  unsigned char c;
-  unsigned char has_dle;
-  unsigned char has_stx;
-  unsigned long start;
+  size_t n;
+  trace_entry *e;
+
+  if (get_time_us() < replay_read_due()) return 0;
+
+  e = &replay.entries[replay.read_next];
+  n = e->len - replay.read_pos;
+  if (n > count) n = count;
+  memcpy(buf, e->data + replay.read_pos, n);
+  replay.read_pos += n;
+  replay.bytes_read += n;
+  if (replay.read_pos == e->len) {
+    e->done_at = get_time_us();
+    replay.read_next++;
+    replay.read_pos = 0;
+    replay_check_end();
+  }
 
-  if (verbose) printf("recv_packet_header_size\n");
+  return n;
+}
 
-  /* receive the header of packet */
-  c = 0;
-  has_dle = 0;
-  has_stx = 0;
-  start = get_time();
-  do {
-    ret = read(fd, &c, 1);
-    if (verbose && (ret > 0)) printf("RECEIVED 1: %X\n", c);
-  } while ((c != 0x10) && !ctrlc && time_valid(start));
-  c = 0;
-  ret = 0;
-  has_dle = 1;
-  do {
-    ret = read(fd, &c, 1);
-    if (ret > 0) {
-      if (verbose) printf("RECEIVED 2: %X\n", c);
-      if (c == 0x02) {
-        has_stx = 1;
-      }
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static ssize_t replay_write(const void *buf, size_t count)
+{
+  size_t n;
+  size_t done = 0;
+  trace_entry *e;
+
+  while (done < count) {
+    while ((replay.write_next < replay.count) && (replay.entries[replay.write_next].type != TRACE_WRITE)) replay.write_next++;
+    if (replay.write_next >= replay.count) {
+      if (!replay.mismatches++) printf("\nReplay: host writes past the end of the trace\n");
       break;
     }
-  } while (!ctrlc && time_valid(start));
-
-  if (ctrlc) return -1;
-  if (!has_dle || !has_stx) {
-    printf("TIMEOUT: DLE and/or STX not received!\n");
-    return -2;
-  }
 
-  /* receive the size */
-  available = -1;
-  {
-    ssize_t i = 0;
-    ssize_t j = 4;
-    unsigned char buff_size[4];
-    start = get_time();
-    do {
-      ret = read(fd, buff_size + i, j);
-      i += ret;
-      j -= ret;
-    } while ((j > 0) && !ctrlc && time_valid(start));
-    if (i == 4) {
-      available = long_from_array(buff_size);
-      if (verbose) printf("Received packet: %d %d %d %d => Total: %ld\n", buff_size[0], buff_size[1], buff_size[2], buff_size[3], available);
+    e = &replay.entries[replay.write_next];
+    n = e->len - replay.write_pos;
+    if (n > (count - done)) n = count - done;
+    if (memcmp(e->data + replay.write_pos, (const unsigned char *)buf + done, n)) {
+      if (!replay.mismatches++) printf("\nReplay: host write differs from record %lu\n", replay.write_next);
+    }
+    replay.write_pos += n;
+    done += n;
+    if (replay.write_pos == e->len) {
+      e->done_at = get_time_us();
+      replay.write_next++;
+      replay.write_pos = 0;
     }
   }
+  replay.bytes_written += count;
+  replay_check_end();
 
-  if (ctrlc) return -1;
-  if (available == -1) {
-    printf("Error receiving packet size\n");
-    return -3;
-  }
+  return count;
+}
 
-  return available;
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static int replay_wait(unsigned int in_milliseconds)
+{
+  unsigned long long now = get_time_us();
+  unsigned long long until = now + (in_milliseconds * 1000ULL);
+  unsigned long long due = replay_read_due();
+
+  if (due < until) until = due;
+  if (until > now) sleep_us(until - now);
+
+  return get_time_us() >= due;
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static unsigned char recv_routine_buffer(HANDLE fd, ssize_t packet_size, unsigned char *out_buff, ssize_t out_buff_size, unsigned char print_state)
+/* all serial traffic of the host goes through these, for --record and --replay */
+static ssize_t serial_read(HANDLE fd, void *buf, size_t count)
 {
   ssize_t ret;
-  ssize_t start;
-  ssize_t offset;
-  const ssize_t _packet_size = packet_size;
 
-  if (verbose) printf("recv_routine_buffer\n");
+  if (replay.active) return replay_read(buf, count);
 
-  offset = 0;
-  start = get_time();
-  do {
-    ret = read(fd, out_buff + offset, packet_size);
-    if (ret > 0) {
-      if ((offset + ret) > out_buff_size) {
-        printf("Not enough space in buffer!\n");
-        return 4;
-      }
-      offset += ret;
-      packet_size -= ret;
-      start = get_time();
-    }
-    else if (ret == 0) {
-      wait_ms(10); /* let's wait */
-    }
+  ret = read(fd, buf, count);
+  if (trace_fp && (ret > 0)) trace_record(TRACE_READ, buf, ret);
+  return ret;
+}
+
+static ssize_t serial_write(HANDLE fd, const void *buf, size_t count)
+{
+  ssize_t ret;
+
+  if (replay.active) return replay_write(buf, count);
+
+  ret = write(fd, buf, count);
+  if (trace_fp && (ret > 0)) trace_record(TRACE_WRITE, buf, ret);
+  return ret;
+}
+
+static int serial_wait(HANDLE fd, unsigned int in_milliseconds)
+{
+  if (replay.active) return replay_wait(in_milliseconds);
+  return wait_readable(fd, in_milliseconds);
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+/* time on the wire, 10 bits per byte */
+#define link_bytes_us(N)   ( ((unsigned long long)(N) * 10ULL * 1000000ULL) / serial_link.baud )
+
+static unsigned long link_timeout(unsigned long bytes)
+{
+  unsigned long long gap;
+  unsigned long long expected;
+  unsigned long timeout;
+
+  /* the next chunk on the wire, or the gaps seen so far when the firmware is slower */
+  expected = link_bytes_us(bytes);
+  gap = serial_link.gap_us + (4 * serial_link.gap_dev_us);
+  if (gap > expected) expected = gap;
+
+  timeout = TIMEOUT_MIN + ((expected * TIMEOUT_CHUNKS) / 1000);
+  if (timeout > (SERIAL_TIMEOUT * 1000)) timeout = SERIAL_TIMEOUT * 1000;
+
+  return timeout;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void link_observe_gap(unsigned long long gap)
+{
+  unsigned long dev;
+
+  /* same estimator as TCP round trip times: average 1/8, deviation 1/4 */
+  if (gap > (SERIAL_TIMEOUT * 1000000ULL)) gap = SERIAL_TIMEOUT * 1000000ULL;
+  dev = (gap > serial_link.gap_us) ? (gap - serial_link.gap_us) : (serial_link.gap_us - gap);
+  serial_link.gap_dev_us = serial_link.gap_dev_us - (serial_link.gap_dev_us / 4) + (dev / 4);
+  serial_link.gap_us = serial_link.gap_us - (serial_link.gap_us / 8) + (gap / 8);
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static long link_resync(HANDLE fd)
+{
+  ssize_t ret;
+  long discarded = 0;
+  unsigned char junk[64];
+  unsigned long last;
+  unsigned long quiet;
+  unsigned long start;
+
+  /* drop what is still coming until the line is quiet, the firmware is back in its command loop */
+  quiet = link_timeout(recv_chunk_size);
+  start = get_time();
+  last = start;
+  while (!ctrlc && time_within(last, quiet)) {
+    if (!time_valid(start)) {
+      printf("Firmware still sending after %d s\n", SERIAL_TIMEOUT);
+      return -1;
+    }
+    ret = serial_read(fd, junk, sizeof(junk));
+    if (ret > 0) {
+      discarded += ret;
+      last = get_time();
+    }
+    else {
+      serial_wait(fd, POLL_INTERVAL);
+    }
+  }
+  if (verbose) printf("Resync: %ld bytes discarded\n", discarded);
+
+  return discarded;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char get_file_size(const char *path, ssize_t *out_size)
+{
+  struct stat tmp;
+  *out_size = 0;
+  if (stat(path, &tmp) != 0) return 1;
+  *out_size = (ssize_t)tmp.st_size;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char read_yes_no()
+{
+  int option;
+  int clear_option;
+
+  if (assume_yes) {
+    printf("y\n");
+    return 1;
+  }
+
+  option = getchar();
+  do { clear_option = getchar(); } while ((clear_option != '\n') && (clear_option != EOF));
+
+  return (option == 'y');
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void print_packet(const unsigned char *packet, long packet_size)
+{
+  long i;
+  for (i = 0; i < packet_size; i++) {
+    printf("%02X ", packet[i]);
+  }
+  printf("\n");
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned short crc16_update(unsigned short crc, unsigned char data)
+{
+  int i;
+  /* CRC16 XMODEM, same as avr-libc _crc_xmodem_update */
+  crc ^= (unsigned short)data << 8;
+  for (i = 0; i < 8; i++) {
+    crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+  }
+  return crc;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned long crc32_table[256];
+
+static void crc32_init_table()
+{
+  unsigned long i;
+  unsigned long j;
+  unsigned long c;
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (j = 0; j < 8; j++) {
+      c = (c & 1) ? (0xEDB88320UL ^ (c >> 1)) : (c >> 1);
+    }
+    crc32_table[i] = c;
+  }
+}
+
+static unsigned long crc32_update(unsigned long crc, const unsigned char *data, size_t len)
+{
+  /* crc starts at 0, same as zlib crc32() */
+  crc = ~crc & 0xFFFFFFFFUL;
+  while (len--) {
+    crc = crc32_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc & 0xFFFFFFFFUL;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+#define rol32(V, N)   ( (((V) << (N)) | ((V) >> (32 - (N)))) & 0xFFFFFFFFUL )
+
+typedef struct {
+  unsigned long state[4];
+  unsigned long long length;
+  unsigned char block[64];
+  unsigned int used;
+} md5_ctx;
+
+static const unsigned long md5_k[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char md5_r[64] = {
+  7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+  5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+  4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+  6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void md5_block(md5_ctx *ctx, const unsigned char *p)
+{
+  int i;
+  unsigned long a, b, c, d, f, g, t;
+  unsigned long w[16];
+
+  for (i = 0; i < 16; i++) {
+    w[i] = (unsigned long)p[i * 4] | ((unsigned long)p[(i * 4) + 1] << 8) | ((unsigned long)p[(i * 4) + 2] << 16) | ((unsigned long)p[(i * 4) + 3] << 24);
+  }
+  a = ctx->state[0];
+  b = ctx->state[1];
+  c = ctx->state[2];
+  d = ctx->state[3];
+  for (i = 0; i < 64; i++) {
+    if (i < 16)      { f = (b & c) | (~b & d);  g = i; }
+    else if (i < 32) { f = (d & b) | (~d & c);  g = ((5 * i) + 1) & 15; }
+    else if (i < 48) { f = b ^ c ^ d;           g = ((3 * i) + 5) & 15; }
+    else             { f = c ^ (b | ~d);        g = (7 * i) & 15; }
+    t = d;
+    d = c;
+    c = b;
+    f = (a + (f & 0xFFFFFFFFUL) + md5_k[i] + w[g]) & 0xFFFFFFFFUL;
+    b = (b + rol32(f, md5_r[i])) & 0xFFFFFFFFUL;
+    a = t;
+  }
+  ctx->state[0] = (ctx->state[0] + a) & 0xFFFFFFFFUL;
+  ctx->state[1] = (ctx->state[1] + b) & 0xFFFFFFFFUL;
+  ctx->state[2] = (ctx->state[2] + c) & 0xFFFFFFFFUL;
+  ctx->state[3] = (ctx->state[3] + d) & 0xFFFFFFFFUL;
+}
+
+static void md5_init(md5_ctx *ctx)
+{
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xefcdab89;
+  ctx->state[2] = 0x98badcfe;
+  ctx->state[3] = 0x10325476;
+  ctx->length = 0;
+  ctx->used = 0;
+}
+
+static void md5_update(md5_ctx *ctx, const unsigned char *data, size_t len)
+{
+  ctx->length += len;
+  while (len--) {
+    ctx->block[ctx->used++] = *data++;
+    if (ctx->used == 64) {
+      md5_block(ctx, ctx->block);
+      ctx->used = 0;
+    }
+  }
+}
+
+static void md5_final(md5_ctx *ctx, unsigned char out[16])
+{
+  int i;
+  unsigned char pad[72];
+  unsigned long long bits = ctx->length * 8;
+  size_t pad_len = (ctx->used < 56) ? (56 - ctx->used) : (120 - ctx->used);
+
+  memset(pad, 0, sizeof(pad));
+  pad[0] = 0x80;
+  for (i = 0; i < 8; i++) pad[pad_len + i] = (bits >> (8 * i)) & 0xFF;
+  md5_update(ctx, pad, pad_len + 8);
+  for (i = 0; i < 16; i++) out[i] = (ctx->state[i / 4] >> (8 * (i % 4))) & 0xFF;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+typedef struct {
+  unsigned long state[5];
+  unsigned long long length;
+  unsigned char block[64];
+  unsigned int used;
+} sha1_ctx;
+
+static void sha1_block(sha1_ctx *ctx, const unsigned char *p)
+{
+  int i;
+  unsigned long a, b, c, d, e, f, k, t;
+  unsigned long w[80];
+
+  for (i = 0; i < 16; i++) {
+    w[i] = ((unsigned long)p[i * 4] << 24) | ((unsigned long)p[(i * 4) + 1] << 16) | ((unsigned long)p[(i * 4) + 2] << 8) | (unsigned long)p[(i * 4) + 3];
+  }
+  for (i = 16; i < 80; i++) {
+    t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+    w[i] = rol32(t, 1);
+  }
+  a = ctx->state[0];
+  b = ctx->state[1];
+  c = ctx->state[2];
+  d = ctx->state[3];
+  e = ctx->state[4];
+  for (i = 0; i < 80; i++) {
+    if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+    else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+    else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+    else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+    t = (rol32(a, 5) + (f & 0xFFFFFFFFUL) + e + k + w[i]) & 0xFFFFFFFFUL;
+    e = d;
+    d = c;
+    c = rol32(b, 30);
+    b = a;
+    a = t;
+  }
+  ctx->state[0] = (ctx->state[0] + a) & 0xFFFFFFFFUL;
+  ctx->state[1] = (ctx->state[1] + b) & 0xFFFFFFFFUL;
+  ctx->state[2] = (ctx->state[2] + c) & 0xFFFFFFFFUL;
+  ctx->state[3] = (ctx->state[3] + d) & 0xFFFFFFFFUL;
+  ctx->state[4] = (ctx->state[4] + e) & 0xFFFFFFFFUL;
+}
+
+static void sha1_init(sha1_ctx *ctx)
+{
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xEFCDAB89;
+  ctx->state[2] = 0x98BADCFE;
+  ctx->state[3] = 0x10325476;
+  ctx->state[4] = 0xC3D2E1F0;
+  ctx->length = 0;
+  ctx->used = 0;
+}
+
+static void sha1_update(sha1_ctx *ctx, const unsigned char *data, size_t len)
+{
+  ctx->length += len;
+  while (len--) {
+    ctx->block[ctx->used++] = *data++;
+    if (ctx->used == 64) {
+      sha1_block(ctx, ctx->block);
+      ctx->used = 0;
+    }
+  }
+}
+
+static void sha1_final(sha1_ctx *ctx, unsigned char out[20])
+{
+  int i;
+  unsigned char pad[72];
+  unsigned long long bits = ctx->length * 8;
+  size_t pad_len = (ctx->used < 56) ? (56 - ctx->used) : (120 - ctx->used);
+
+  memset(pad, 0, sizeof(pad));
+  pad[0] = 0x80;
+  for (i = 0; i < 8; i++) pad[pad_len + i] = (bits >> (56 - (8 * i))) & 0xFF;
+  sha1_update(ctx, pad, pad_len + 8);
+  for (i = 0; i < 20; i++) out[i] = (ctx->state[i / 4] >> (24 - (8 * (i % 4)))) & 0xFF;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+typedef struct {
+  /* whole image */
+  unsigned long crc32;
+  md5_ctx md5;
+  sha1_ctx sha1;
+  unsigned char md5_sum[16];
+  unsigned char sha1_sum[20];
+  /* per bank */
+  unsigned long bank_size;
+  unsigned long banks;
+  unsigned long *bank_crc32;
+  unsigned char (*bank_sha1)[20];
+  sha1_ctx bank_ctx;
+  /* cartridge global checksum, 0x014E-0x014F */
+  unsigned char is_rom;
+  unsigned short global_sum;
+  unsigned short global_expected;
+  unsigned long offset;
+} dump_digest;
+
+static void digest_init(dump_digest *dg, unsigned long total_size, unsigned long bank_size, unsigned char is_rom)
+{
+  memset(dg, 0, sizeof(*dg));
+  md5_init(&dg->md5);
+  sha1_init(&dg->sha1);
+  sha1_init(&dg->bank_ctx);
+  dg->bank_size = (total_size < bank_size) ? total_size : bank_size;
+  dg->banks = dg->bank_size ? ((total_size + dg->bank_size - 1) / dg->bank_size) : 0;
+  dg->bank_crc32 = (unsigned long *)calloc(dg->banks + 1, sizeof(unsigned long)); // assume success
+  dg->bank_sha1 = (unsigned char (*)[20])calloc(dg->banks + 1, 20); // assume success
+  dg->is_rom = is_rom;
+}
+
+static void digest_update(dump_digest *dg, const unsigned char *data, size_t len)
+{
+  size_t i;
+
+  dg->crc32 = crc32_update(dg->crc32, data, len);
+  md5_update(&dg->md5, data, len);
+  sha1_update(&dg->sha1, data, len);
+
+  while (len > 0) {
+    unsigned long bank = dg->offset / dg->bank_size;
+    size_t n = dg->bank_size - (dg->offset % dg->bank_size);
+    if (n > len) n = len;
+    if (dg->is_rom) {
+      for (i = 0; i < n; i++) {
+        unsigned long address = dg->offset + i;
+        if (address == 0x014E) dg->global_expected |= data[i] << 8;
+        else if (address == 0x014F) dg->global_expected |= data[i];
+        else dg->global_sum += data[i];
+      }
+    }
+    dg->bank_crc32[bank] = crc32_update(dg->bank_crc32[bank], data, n);
+    sha1_update(&dg->bank_ctx, data, n);
+    dg->offset += n;
+    data += n;
+    len -= n;
+    if ((dg->offset % dg->bank_size) == 0) {
+      sha1_final(&dg->bank_ctx, dg->bank_sha1[bank]);
+      sha1_init(&dg->bank_ctx);
+    }
+  }
+}
+
+static void digest_final(dump_digest *dg)
+{
+  md5_final(&dg->md5, dg->md5_sum);
+  sha1_final(&dg->sha1, dg->sha1_sum);
+}
+
+static void digest_free(dump_digest *dg)
+{
+  free(dg->bank_crc32);
+  free(dg->bank_sha1);
+}
+
+static void print_hex(FILE *fp, const unsigned char *data, int len)
+{
+  int i;
+  for (i = 0; i < len; i++) fprintf(fp, "%02x", data[i]);
+}
+
+static void print_digest(const dump_digest *dg)
+{
+  printf("CRC32: %08lx\n", dg->crc32);
+  printf("MD5: ");
+  print_hex(stdout, dg->md5_sum, 16);
+  printf("\nSHA-1: ");
+  print_hex(stdout, dg->sha1_sum, 20);
+  printf("\n");
+  if (dg->is_rom) {
+    if (dg->global_sum == dg->global_expected) {
+      printf("Global checksum: %04X OK\n", dg->global_expected);
+    }
+    else {
+      printf("Global checksum: %04X NOK(computed %04X)\n", dg->global_expected, dg->global_sum);
+    }
+  }
+}
+
+/* returns 0 or the errno of the failure, station workers must not print */
+static int write_manifest(const dump_digest *dg, const char *filename)
+{
+  FILE *fp;
+  unsigned long i;
+  char *manifest_filename;
+
+  manifest_filename = (char *)malloc(strlen(filename) + sizeof(".manifest")); // assume success
+  sprintf(manifest_filename, "%s.manifest", filename);
+  fp = fopen(manifest_filename, "w");
+  if (!fp) {
+    int err = errno;
+    free(manifest_filename);
+    return err;
+  }
+  free(manifest_filename);
+
+  fprintf(fp, "file: %s\n", filename);
+  fprintf(fp, "size: %lu\n", dg->offset);
+  fprintf(fp, "crc32: %08lx\n", dg->crc32);
+  fprintf(fp, "md5: ");
+  print_hex(fp, dg->md5_sum, 16);
+  fprintf(fp, "\nsha1: ");
+  print_hex(fp, dg->sha1_sum, 20);
+  fprintf(fp, "\n");
+  if (dg->is_rom) {
+    fprintf(fp, "global checksum: %04x (%s)\n", dg->global_expected, (dg->global_sum == dg->global_expected) ? "OK" : "NOK");
+  }
+  for (i = 0; i < dg->banks; i++) {
+    fprintf(fp, "bank %lu: crc32 %08lx sha1 ", i, dg->bank_crc32[i]);
+    print_hex(fp, dg->bank_sha1[i], 20);
+    fprintf(fp, "\n");
+  }
+
+  return fclose(fp) ? errno : 0;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+#define ARCHIVE_DIR           "gbx-archive"
+#define ARCHIVE_PACK          ARCHIVE_DIR "/blocks.pack"
+#define ARCHIVE_LOG           ARCHIVE_DIR "/snapshots.log"
+#define ARCHIVE_BLOCK_SIZE    ( 1024 ) /* also the LZ window, offsets fit 10 bits */
+
+#define ARCHIVE_LIST_MAX      ( 20   )
+
+#define ARCHIVE_KIND_ROM      'R'
+#define ARCHIVE_KIND_SAVE     'S'
+
+/* pack record: SHA1(20) + RAW_LEN(2) + COMP_LEN(2) + DATA, COMP_LEN == RAW_LEN means stored */
+#define PACK_RECORD_HEADER    ( 24 )
+/* log record: 'S' + KIND + TITLE(16) + TIME(8) + SIZE(4) + BLOCKS(4) + SHA1(20) * BLOCKS */
+#define LOG_RECORD_HEADER     ( 34 )
+
+typedef struct {
+  unsigned char sha1[20];
+  long offset;             /* of the record data in the pack */
+  unsigned short raw_len;
+  unsigned short comp_len;
+  unsigned char used;
+} archive_entry;
+
+typedef struct {
+  FILE *pack;
+  archive_entry *entries;
+  unsigned long capacity;  /* power of 2 */
+  unsigned long count;
+} archive;
+
+typedef struct {
+  long offset;             /* of the hash list in the log */
+  char kind;
+  char title[17];
+  unsigned long long time;
+  unsigned long size;
+  unsigned long blocks;
+} archive_snapshot;
+
+/* outcome of a store, printed by the caller since station workers must not print */
+typedef struct {
+  unsigned long blocks;
+  unsigned long new_blocks;
+  unsigned long stored;
+  const char *action;      /* "opening", "reading", "writing to", NULL when stored */
+  const char *failed;      /* file of the failure */
+  int error;               /* errno of the failure */
+} archive_result;
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static size_t lz_compress(const unsigned char *in, size_t len, unsigned char *out)
+{
+  size_t i;
+  size_t o;
+  size_t flag_pos;
+  int bit;
+  unsigned short head[4096];
+
+  /* LZSS: flag byte per 8 items, literal byte or match word OFFSET-1(10) + LENGTH-3(6) */
+  memset(head, 0xFF, sizeof(head));
+  o = 0;
+  bit = 8;
+  flag_pos = 0;
+  for (i = 0; i < len;) {
+    size_t best_len = 0;
+    size_t best_off = 0;
+    if (bit == 8) {
+      flag_pos = o++;
+      out[flag_pos] = 0;
+      bit = 0;
+    }
+    if ((i + 3) <= len) {
+      unsigned int h = ((in[i] << 4) ^ (in[i + 1] << 2) ^ in[i + 2]) & 0xFFF;
+      unsigned short candidate = head[h];
+      head[h] = i;
+      if ((candidate != 0xFFFF) && ((i - candidate) < 1024)) {
+        size_t n = 0;
+        while (((i + n) < len) && (n < 66) && (in[candidate + n] == in[i + n])) n++;
+        if (n >= 3) {
+          best_len = n;
+          best_off = i - candidate;
+        }
+      }
+    }
+    if (best_len) {
+      unsigned short word = ((best_off - 1) << 6) | (best_len - 3);
+      out[flag_pos] |= 1 << bit;
+      out[o++] = word >> 8;
+      out[o++] = word & 0xFF;
+      i += best_len;
+    }
+    else {
+      out[o++] = in[i++];
+    }
+    bit++;
+  }
+
+  return o;
+}
+
+static unsigned char lz_decompress(const unsigned char *in, size_t len, unsigned char *out, size_t out_len)
+{
+  size_t i = 0;
+  size_t o = 0;
+  int bit;
+  unsigned char flags;
+
+  while ((i < len) && (o < out_len)) {
+    flags = in[i++];
+    for (bit = 0; (bit < 8) && (i < len) && (o < out_len); bit++) {
+      if (flags & (1 << bit)) {
+        size_t n;
+        size_t off;
+        unsigned short word;
+        if ((i + 2) > len) return 1;
+        word = (in[i] << 8) | in[i + 1];
+        i += 2;
+        off = (word >> 6) + 1;
+        n = (word & 0x3F) + 3;
+        if ((off > o) || ((o + n) > out_len)) return 2;
+        while (n--) {
+          out[o] = out[o - off];
+          o++;
+        }
+      }
+      else {
+        out[o++] = in[i++];
+      }
+    }
+  }
+
+  return (o != out_len);
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static archive_entry* archive_lookup(archive *ar, const unsigned char sha1[20])
+{
+  unsigned long i = ((unsigned long)sha1[0] << 24 | (unsigned long)sha1[1] << 16 | sha1[2] << 8 | sha1[3]) & (ar->capacity - 1);
+  while (ar->entries[i].used && memcmp(ar->entries[i].sha1, sha1, 20)) {
+    i = (i + 1) & (ar->capacity - 1);
+  }
+  return &ar->entries[i];
+}
+
+static void archive_insert(archive *ar, const unsigned char sha1[20], long offset, unsigned short raw_len, unsigned short comp_len)
+{
+  archive_entry *entry;
+
+  /* keep the table at most half full */
+  if (((ar->count + 1) * 2) > ar->capacity) {
+    unsigned long i;
+    archive old = *ar;
+    ar->capacity = old.capacity ? (old.capacity * 2) : 1024;
+    ar->entries = (archive_entry *)calloc(ar->capacity, sizeof(archive_entry)); // assume success
+    for (i = 0; i < old.capacity; i++) {
+      if (old.entries[i].used) *archive_lookup(ar, old.entries[i].sha1) = old.entries[i];
+    }
+    free(old.entries);
+  }
+
+  entry = archive_lookup(ar, sha1);
+  if (entry->used) return;
+  memcpy(entry->sha1, sha1, 20);
+  entry->offset = offset;
+  entry->raw_len = raw_len;
+  entry->comp_len = comp_len;
+  entry->used = 1;
+  ar->count++;
+}
+
+static unsigned char archive_open(archive *ar)
+{
+  long pack_size;
+  long valid = 0;
+  unsigned char header[PACK_RECORD_HEADER];
+
+  memset(ar, 0, sizeof(*ar));
+  make_dir(ARCHIVE_DIR);
+
+  ar->pack = fopen(ARCHIVE_PACK, "a+b");
+  if (!ar->pack) return 1;
+
+  /* rebuild the block index */
+  ar->capacity = 1024;
+  ar->entries = (archive_entry *)calloc(ar->capacity, sizeof(archive_entry)); // assume success
+  fseek(ar->pack, 0, SEEK_END);
+  pack_size = ftell(ar->pack);
+  rewind(ar->pack);
+  while (fread(header, 1, PACK_RECORD_HEADER, ar->pack) == PACK_RECORD_HEADER) {
+    long offset = ftell(ar->pack);
+    unsigned short raw_len = (header[20] << 8) | header[21];
+    unsigned short comp_len = (header[22] << 8) | header[23];
+    /* a record torn by a failed write ends the pack */
+    if ((raw_len == 0) || (raw_len > ARCHIVE_BLOCK_SIZE) || (comp_len > raw_len) || ((offset + comp_len) > pack_size)) break;
+    archive_insert(ar, header, offset, raw_len, comp_len);
+    if (fseek(ar->pack, comp_len, SEEK_CUR)) break;
+    valid = offset + comp_len;
+  }
+
+  /* drop the torn tail so new records are appended after the last complete one */
+  if (valid != pack_size) {
+    if (truncate_file(ar->pack, valid)) return 2;
+  }
+
+  return 0;
+}
+
+static void archive_close(archive *ar)
+{
+  if (ar->pack) fclose(ar->pack);
+  free(ar->entries);
+  memset(ar, 0, sizeof(*ar));
+}
+
+/* after the stream is closed, so nothing left in its buffer lands past the cut */
+static unsigned char truncate_path(const char *path, long size)
+{
+  unsigned char ret;
+  FILE *fp = fopen(path, "r+b");
+  if (!fp) return 1;
+  ret = (truncate_file(fp, size) != 0);
+  fclose(fp);
+  return ret;
+}
+
+/* the block index is built from the pack once per run and kept up to date by every store */
+static archive shared_archive;
+
+/* NULL with errno set when the pack can't be opened */
+static archive* archive_get()
+{
+  if (!shared_archive.pack && archive_open(&shared_archive)) {
+    int err = errno;
+    archive_close(&shared_archive);
+    errno = err;
+    return NULL;
+  }
+  return &shared_archive;
+}
+
+static unsigned char archive_put_block(archive *ar, const unsigned char *data, unsigned short len, unsigned char sha1[20], unsigned long *stored)
+{
+  sha1_ctx ctx;
+  size_t comp_len;
+  unsigned char header[PACK_RECORD_HEADER];
+  unsigned char comp[ARCHIVE_BLOCK_SIZE + (ARCHIVE_BLOCK_SIZE / 8) + 2];
+
+  sha1_init(&ctx);
+  sha1_update(&ctx, data, len);
+  sha1_final(&ctx, sha1);
+  if (archive_lookup(ar, sha1)->used) return 0;
+
+  comp_len = lz_compress(data, len, comp);
+  if (comp_len >= len) {
+    memcpy(comp, data, len);
+    comp_len = len;
+  }
+
+  memcpy(header, sha1, 20);
+  header[20] = len >> 8;
+  header[21] = len & 0xFF;
+  header[22] = comp_len >> 8;
+  header[23] = comp_len & 0xFF;
+  fseek(ar->pack, 0, SEEK_END);
+  if ((fwrite(header, 1, PACK_RECORD_HEADER, ar->pack) != PACK_RECORD_HEADER) || (fwrite(comp, 1, comp_len, ar->pack) != comp_len)) return 1;
+  archive_insert(ar, sha1, ftell(ar->pack) - comp_len, len, comp_len);
+  *stored += PACK_RECORD_HEADER + comp_len;
+
+  return 0;
+}
+
+static unsigned char archive_get_block(archive *ar, const unsigned char sha1[20], unsigned char *out, unsigned short *out_len)
+{
+  sha1_ctx ctx;
+  unsigned char sum[20];
+  archive_entry *entry = archive_lookup(ar, sha1);
+  unsigned char comp[ARCHIVE_BLOCK_SIZE];
+
+  if (!entry->used || (entry->raw_len > ARCHIVE_BLOCK_SIZE) || (entry->comp_len > ARCHIVE_BLOCK_SIZE)) return 1;
+  if (fseek(ar->pack, entry->offset, SEEK_SET) || (fread(comp, 1, entry->comp_len, ar->pack) != entry->comp_len)) return 2;
+
+  *out_len = entry->raw_len;
+  if (entry->comp_len == entry->raw_len) memcpy(out, comp, entry->raw_len);
+  else if (lz_decompress(comp, entry->comp_len, out, entry->raw_len)) return 3;
+
+  /* the block must still be the one it is named after */
+  sha1_init(&ctx);
+  sha1_update(&ctx, out, entry->raw_len);
+  sha1_final(&ctx, sum);
+  return memcmp(sum, sha1, 20) ? 4 : 0;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char archive_store_file(const char *path, const char *title, char kind, archive_result *res)
+{
+  FILE *fp;
+  FILE *log;
+  archive *ar;
+  size_t len;
+  unsigned long i;
+  unsigned long blocks;
+  unsigned long long now;
+  unsigned char *hashes;
+  unsigned char *size_bytes;
+  unsigned char header[LOG_RECORD_HEADER];
+  unsigned char block[ARCHIVE_BLOCK_SIZE];
+  ssize_t file_size;
+  long pack_size;
+  long log_size;
+  unsigned char ret = 1;
+
+  memset(res, 0, sizeof(*res));
+  if (get_file_size(path, &file_size) || (file_size == 0)) return 1;
+
+  res->action = "opening";
+  res->failed = path;
+  fp = fopen(path, "rb");
+  if (!fp) {
+    res->error = errno;
+    return 1;
+  }
+  res->failed = ARCHIVE_PACK;
+  ar = archive_get();
+  if (!ar) {
+    res->error = errno;
+    fclose(fp);
+    return 1;
+  }
+
+  blocks = (file_size + ARCHIVE_BLOCK_SIZE - 1) / ARCHIVE_BLOCK_SIZE;
+  hashes = (unsigned char *)malloc(blocks * 20); // assume success
+  fseek(ar->pack, 0, SEEK_END);
+  pack_size = ftell(ar->pack);
+
+  res->action = "writing to";
+  for (i = 0; i < blocks; i++) {
+    unsigned long count = ar->count;
+    len = fread(block, 1, ARCHIVE_BLOCK_SIZE, fp);
+    if (len == 0) {
+      /* the file shrank since its size was taken */
+      res->action = "reading";
+      res->failed = path;
+      res->error = ferror(fp) ? errno : EIO;
+      goto L_END_ARCHIVE_STORE;
+    }
+    if (archive_put_block(ar, block, len, hashes + (i * 20), &res->stored)) {
+      res->error = errno;
+      goto L_END_ARCHIVE_STORE;
+    }
+    if (ar->count != count) res->new_blocks++;
+  }
+  if (fflush(ar->pack)) {
+    res->error = errno;
+    goto L_END_ARCHIVE_STORE;
+  }
+
+  /* snapshot record */
+  res->action = "opening";
+  res->failed = ARCHIVE_LOG;
+  log = fopen(ARCHIVE_LOG, "ab");
+  if (!log) {
+    res->error = errno;
+    goto L_END_ARCHIVE_STORE;
+  }
+  fseek(log, 0, SEEK_END);
+  log_size = ftell(log);
+  memset(header, 0, sizeof(header));
+  header[0] = 'S';
+  header[1] = kind;
+  strncpy((char *)header + 2, title, 16);
+  now = (unsigned long long)time(NULL);
+  for (i = 0; i < 8; i++) header[18 + i] = (now >> (56 - (8 * i))) & 0xFF;
+  size_bytes = header + 26;
+  long_to_array(size_bytes, (unsigned long)file_size);
+  size_bytes = header + 30;
+  long_to_array(size_bytes, blocks);
+  res->action = "writing to";
+  if ((fwrite(header, 1, sizeof(header), log) != sizeof(header)) || (fwrite(hashes, 20, blocks, log) != blocks) || fflush(log)) {
+    res->error = errno;
+  }
+  else {
+    res->blocks = blocks;
+    res->action = NULL;
+    res->failed = NULL;
+    ret = 0;
+  }
+  fclose(log);
+  /* no half snapshot record */
+  if (ret) truncate_path(ARCHIVE_LOG, log_size);
+
+L_END_ARCHIVE_STORE:
+  if (ret) {
+    /* cut the records of this store, the index is rebuilt by the next one */
+    archive_close(ar);
+    truncate_path(ARCHIVE_PACK, pack_size);
+  }
+  free(hashes);
+  fclose(fp);
+  return ret;
+}
+
+static void print_archive_result(const char *path, const archive_result *res)
+{
+  if (res->action) {
+    printf("Error %s %s: %s\n", res->action, res->failed, strerror(res->error));
+  }
+  else if (res->blocks) {
+    printf("Archived %s: %lu blocks, %lu new, %lu bytes stored\n", path, res->blocks, res->new_blocks, res->stored);
+  }
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned long archive_list(const char *title, char kind, unsigned long size, archive_snapshot *out, unsigned long max)
+{
+  FILE *log;
+  unsigned long i;
+  unsigned long count = 0;
+  unsigned char *size_bytes;
+  unsigned char header[LOG_RECORD_HEADER];
+  archive_snapshot snap;
+  long log_size;
+
+  log = fopen(ARCHIVE_LOG, "rb");
+  if (!log) return 0;
+  fseek(log, 0, SEEK_END);
+  log_size = ftell(log);
+  rewind(log);
+
+  while (fread(header, 1, sizeof(header), log) == sizeof(header)) {
+    if (header[0] != 'S') break;
+    memset(&snap, 0, sizeof(snap));
+    snap.kind = header[1];
+    memcpy(snap.title, header + 2, 16);
+    for (i = 0; i < 8; i++) snap.time = (snap.time << 8) | header[18 + i];
+    size_bytes = header + 26;
+    snap.size = long_from_array(size_bytes);
+    size_bytes = header + 30;
+    snap.blocks = long_from_array(size_bytes);
+    snap.offset = ftell(log);
+    /* a torn last record lists blocks that were never written */
+    if ((snap.offset + (long)(snap.blocks * 20)) > log_size) break;
+    if ((snap.kind == kind) && !strcmp(snap.title, title) && (snap.size == size)) {
+      /* keep the newest ones */
+      if (count < max) out[count++] = snap;
+      else {
+        memmove(out, out + 1, (max - 1) * sizeof(archive_snapshot));
+        out[max - 1] = snap;
+      }
+    }
+    if (fseek(log, snap.blocks * 20, SEEK_CUR)) break;
+  }
+
+  fclose(log);
+  return count;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+typedef struct {
+  size_t (*read)(void *ctx, unsigned char *buf, size_t len);
+  void *ctx;
+} tx_source;
+
+typedef struct {
+  archive *ar;
+  unsigned char *hashes;
+  unsigned long blocks;
+  unsigned long next;
+  unsigned char block[ARCHIVE_BLOCK_SIZE];
+  unsigned short block_len;
+  unsigned short block_pos;
+} archive_reader;
+
+static unsigned char archive_reader_open(archive_reader *rd, const archive_snapshot *snap)
+{
+  FILE *log;
+
+  memset(rd, 0, sizeof(*rd));
+  rd->ar = archive_get();
+  if (!rd->ar) {
+    printf("Error opening %s: %s\n", ARCHIVE_PACK, strerror(errno));
+    return 1;
+  }
+
+  rd->blocks = snap->blocks;
+  rd->hashes = (unsigned char *)malloc(rd->blocks * 20); // assume success
+  log = fopen(ARCHIVE_LOG, "rb");
+  if (!log || fseek(log, snap->offset, SEEK_SET) || (fread(rd->hashes, 20, rd->blocks, log) != rd->blocks)) {
+    printf("Error reading %s\n", ARCHIVE_LOG);
+    if (log) fclose(log);
+    return 2;
+  }
+  fclose(log);
+
+  return 0;
+}
+
+static void archive_reader_close(archive_reader *rd)
+{
+  free(rd->hashes);
+}
+
+/* tx_source read callback, decompresses one block at a time */
+static size_t archive_reader_read(void *ctx, unsigned char *buf, size_t len)
+{
+  size_t n;
+  size_t done = 0;
+  archive_reader *rd = (archive_reader *)ctx;
+
+  while (done < len) {
+    if (rd->block_pos == rd->block_len) {
+      if (rd->next == rd->blocks) break;
+      if (archive_get_block(rd->ar, rd->hashes + (rd->next * 20), rd->block, &rd->block_len)) {
+        printf("Archive block %lu missing or corrupted\n", rd->next);
+        break;
+      }
+      rd->next++;
+      rd->block_pos = 0;
+    }
+    n = rd->block_len - rd->block_pos;
+    if (n > (len - done)) n = len - done;
+    memcpy(buf + done, rd->block + rd->block_pos, n);
+    rd->block_pos += n;
+    done += n;
+  }
+
+  return done;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+#if !(defined(_WIN32) || defined(_WIN64))
+#define SELF_TEST_FILE        "self-test.gb"
+#define SELF_TEST_BLOCKS      ( 5 )
+#define SELF_TEST_SIZE        ( (SELF_TEST_BLOCKS - 1) * ARCHIVE_BLOCK_SIZE + 100 )
+
+static unsigned char self_test_restore(const archive_snapshot *snap, const unsigned char *data)
+{
+  archive_reader rd;
+  unsigned char out[SELF_TEST_SIZE + 1];
+  size_t len;
+
+  if (archive_reader_open(&rd, snap)) return 1;
+  len = archive_reader_read(&rd, out, sizeof(out));
+  archive_reader_close(&rd);
+  return (len != SELF_TEST_SIZE) || memcmp(out, data, SELF_TEST_SIZE);
+}
+
+/* store, dedup, restore, torn pack and corrupted block, in a scratch directory so the real archive is not touched */
+static unsigned int self_test_archive()
+{
+  FILE *fp;
+  unsigned long i;
+  unsigned int failures = 0;
+  unsigned char data[SELF_TEST_SIZE];
+  unsigned char hashes[SELF_TEST_BLOCKS][20];
+  unsigned char block[ARCHIVE_BLOCK_SIZE];
+  unsigned short block_len;
+  archive_snapshot snaps[ARCHIVE_LIST_MAX];
+  archive_result res;
+  archive_entry *entry;
+  ssize_t pack_size;
+  long tail;
+  char cwd[4096];
+  char dir[] = "/tmp/gbx-self-test-XXXXXX";
+  sha1_ctx ctx;
+
+  /* block 0 compresses, block 1 is stored raw, block 2 repeats block 0, then a short last block */
+  for (i = 0; i < ARCHIVE_BLOCK_SIZE; i++) data[i] = "GAME BOY"[i % 8] + ((i / 64) & 0x07);
+  srand(1);
+  for (i = ARCHIVE_BLOCK_SIZE; i < (2 * ARCHIVE_BLOCK_SIZE); i++) data[i] = rand() & 0xFF;
+  memcpy(data + (2 * ARCHIVE_BLOCK_SIZE), data, ARCHIVE_BLOCK_SIZE);
+  for (i = 3 * ARCHIVE_BLOCK_SIZE; i < SELF_TEST_SIZE; i++) data[i] = i & 0xFF;
+  for (i = 0; i < SELF_TEST_BLOCKS; i++) {
+    unsigned long len = SELF_TEST_SIZE - (i * ARCHIVE_BLOCK_SIZE);
+    sha1_init(&ctx);
+    sha1_update(&ctx, data + (i * ARCHIVE_BLOCK_SIZE), (len > ARCHIVE_BLOCK_SIZE) ? ARCHIVE_BLOCK_SIZE : len);
+    sha1_final(&ctx, hashes[i]);
+  }
+
+  if (!getcwd(cwd, sizeof(cwd)) || !mkdtemp(dir) || chdir(dir)) {
+    printf("FAIL archive scratch directory: %s\n", strerror(errno));
+    return 1;
+  }
+  archive_close(&shared_archive);
+
+  fp = fopen(SELF_TEST_FILE, "wb");
+  if (!fp || (fwrite(data, 1, SELF_TEST_SIZE, fp) != SELF_TEST_SIZE) || fclose(fp)) {
+    printf("FAIL archive writing %s\n", SELF_TEST_FILE);
+    failures++;
+    goto L_END_SELF_TEST_ARCHIVE;
+  }
+
+  /* LZ and dedup inside the dump */
+  if (archive_store_file(SELF_TEST_FILE, "SELF TEST", ARCHIVE_KIND_ROM, &res) || (res.blocks != SELF_TEST_BLOCKS) || (res.new_blocks != 4)) {
+    printf("FAIL archive store: %lu blocks, %lu new\n", res.blocks, res.new_blocks);
+    failures++;
+  }
+  entry = archive_lookup(&shared_archive, hashes[0]);
+  if (!entry->used || (entry->comp_len >= entry->raw_len) || (archive_lookup(&shared_archive, hashes[1])->comp_len != ARCHIVE_BLOCK_SIZE)) {
+    printf("FAIL archive compression\n");
+    failures++;
+  }
+
+  /* dedup across dumps */
+  if (archive_store_file(SELF_TEST_FILE, "SELF TEST", ARCHIVE_KIND_ROM, &res) || (res.new_blocks != 0) || (res.stored != 0)) {
+    printf("FAIL archive dedup: %lu new, %lu bytes stored\n", res.new_blocks, res.stored);
+    failures++;
+  }
+  if ((archive_list("SELF TEST", ARCHIVE_KIND_ROM, SELF_TEST_SIZE, snaps, ARCHIVE_LIST_MAX) != 2) || self_test_restore(&snaps[1], data)) {
+    printf("FAIL archive restore\n");
+    failures++;
+  }
+
+  /* a pack cut inside its last record loses only that block, which the next store writes again */
+  entry = archive_lookup(&shared_archive, hashes[SELF_TEST_BLOCKS - 1]);
+  tail = entry->offset - PACK_RECORD_HEADER;
+  archive_close(&shared_archive);
+  truncate_path(ARCHIVE_PACK, tail + PACK_RECORD_HEADER + 10);
+  if (!archive_get() || (shared_archive.count != 3) || get_file_size(ARCHIVE_PACK, &pack_size) || (pack_size != tail)) {
+    printf("FAIL archive torn pack: %lu blocks indexed\n", shared_archive.count);
+    failures++;
+  }
+  if (archive_store_file(SELF_TEST_FILE, "SELF TEST", ARCHIVE_KIND_ROM, &res) || (res.new_blocks != 1) ||
+      (archive_list("SELF TEST", ARCHIVE_KIND_ROM, SELF_TEST_SIZE, snaps, ARCHIVE_LIST_MAX) != 3) || self_test_restore(&snaps[2], data)) {
+    printf("FAIL archive store after torn pack: %lu new\n", res.new_blocks);
+    failures++;
+  }
+
+  /* a flipped bit in a stored block is caught by its SHA-1 */
+  entry = archive_lookup(&shared_archive, hashes[1]);
+  tail = entry->offset;
+  archive_close(&shared_archive);
+  fp = fopen(ARCHIVE_PACK, "r+b");
+  if (fp && !fseek(fp, tail + 100, SEEK_SET)) {
+    int c = fgetc(fp);
+    fseek(fp, tail + 100, SEEK_SET);
+    fputc(c ^ 0x01, fp);
+  }
+  if (fp) fclose(fp);
+  if (!archive_get() || (archive_get_block(&shared_archive, hashes[1], block, &block_len) != 4)) {
+    printf("FAIL archive corrupted block not detected\n");
+    failures++;
+  }
+
+L_END_SELF_TEST_ARCHIVE:
+  archive_close(&shared_archive);
+  remove(ARCHIVE_PACK);
+  remove(ARCHIVE_LOG);
+  rmdir(ARCHIVE_DIR);
+  remove(SELF_TEST_FILE);
+  if (chdir(cwd)) failures++;
+  rmdir(dir);
+  return failures;
+}
+#endif /* !(_WIN32 || _WIN64) */
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+/* known answers of the RFC 1321 / FIPS 180 test suites and the usual CRC check value,
+ * then an archive round trip */
+static int run_self_test()
+{
+  unsigned long i;
+  unsigned int v;
+  unsigned int failures = 0;
+  unsigned short crc16 = 0;
+  char md5_hex[33];
+  char sha1_hex[41];
+  dump_digest dg;
+  static const struct {
+    const char *input;
+    unsigned long repeat;
+    unsigned long crc32;
+    const char *md5;
+    const char *sha1;
+  } vectors[] = {
+    { "",           1,      0x00000000, "d41d8cd98f00b204e9800998ecf8427e", "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+    { "abc",        1,      0x352441c2, "900150983cd24fb0d6963f7d28e17f72", "a9993e364706816aba3e25717850c26c9cd0d89d" },
+    { "123456789",  1,      0xcbf43926, "25f9e794323b453885f5181f1b624d0b", "f7c3bc1d808e04732adf679965ccc34ca7ae3441" },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+                            0x171a3f5f, "8215ef0796a20bcaaae116d3876c664a", "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+    /* many updates across banks and blocks */
+    { "aaaaaaaaaa", 100000, 0xdc25bfbc, "7707d6ae4e027c70eea2a935c2296f21", "34aa973cd4c4daa4f61eeb2bdbad27316534016f" },
+  };
+
+  crc32_init_table();
+
+  for (v = 0; v < sizeof(vectors) / sizeof(vectors[0]); v++) {
+    size_t len = strlen(vectors[v].input);
+    digest_init(&dg, len * vectors[v].repeat, 0x4000, 0);
+    for (i = 0; i < vectors[v].repeat; i++) digest_update(&dg, (const unsigned char *)vectors[v].input, len);
+    digest_final(&dg);
+    for (i = 0; i < 16; i++) sprintf(md5_hex + (i * 2), "%02x", dg.md5_sum[i]);
+    for (i = 0; i < 20; i++) sprintf(sha1_hex + (i * 2), "%02x", dg.sha1_sum[i]);
+    if ((dg.crc32 != vectors[v].crc32) || strcmp(md5_hex, vectors[v].md5) || strcmp(sha1_hex, vectors[v].sha1)) {
+      printf("FAIL \"%.16s\" x %lu: crc32 %08lx md5 %s sha1 %s\n", vectors[v].input, vectors[v].repeat, dg.crc32, md5_hex, sha1_hex);
+      failures++;
+    }
+    digest_free(&dg);
+  }
+
+  /* CRC16 XMODEM of the firmware frames */
+  for (i = 0; i < 9; i++) crc16 = crc16_update(crc16, "123456789"[i]);
+  if (crc16 != 0x31C3) {
+    printf("FAIL crc16 %04X\n", crc16);
+    failures++;
+  }
+
+#if !(defined(_WIN32) || defined(_WIN64))
+  failures += self_test_archive();
+#endif /* !(_WIN32 || _WIN64) */
+
+  printf("Self test: %s\n", failures ? "FAILED" : "OK");
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void print_usage(const char *program_name)
+{
+#if defined(_WIN32) || defined(_WIN64)
+  printf("\nUsage: %s <port> [OPTIONS...]\n", program_name);
+  printf("\n");
+  printf("  -v            print debug.\n");
+  printf("  -a            keep dumps in the archive.\n");
+  printf("  --record <file>   record the serial traffic of the session.\n");
+  printf("  --replay <file>   replay a recorded session instead of a device, no port needed.\n");
+  printf("  --speed <factor>  replay speed, 0 for no delays (default 1).\n");
+  printf("\nExample:\n");
+  printf("  %s COM9\n", program_name);
+#else
+  printf("\nUsage: %s -p <port> [OPTIONS...]\n", program_name);
+  printf("\n");
+  printf("  -v, --verbose            print debug.\n");
+  printf("  -a, --archive            keep dumps in the archive.\n");
+  printf("  -h, --help               print this screen.\n");
+  printf("  -b, --bench              benchmark transfers against a pty firmware stand-in.\n");
+  printf("  --baseline <file>        compare benchmark with a saved baseline.\n");
+  printf("  --save-baseline <file>   save benchmark results as baseline.\n");
+  printf("  --record <file>          record the serial traffic of the session.\n");
+  printf("  --replay <file>          replay a recorded session instead of a device.\n");
+  printf("  --speed <factor>         replay speed, 0 for no delays (default 1).\n");
+  printf("  --self-test              check the digests against known answers.\n");
+  printf("\nExample:\n");
+  printf("  %s -p /dev/ttyACM0\n", program_name);
+#endif /* _WIN32 || _WIN64 */
+  printf("\n");
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static const char* print_cartridge_string(unsigned char cartridge_type)
+{
+  switch (cartridge_type) {
+    case 0x00:   return("00h - ROM ONLY");
+    case 0x01:   return("01h - MBC1");
+    case 0x02:   return("02h - MBC1+RAM");
+    case 0x03:   return("03h - MBC1+RAM+BATTERY");
+    case 0x05:   return("05h - MBC2");
+    case 0x06:   return("06h - MBC2+BATTERY");
+    case 0x08:   return("08h - ROM+RAM");
+    case 0x09:   return("09h - ROM+RAM+BATTERY");
+    case 0x0B:   return("08h - MMM01");
+    case 0x0C:   return("0Ch - MMM01+RAM");
+    case 0x0D:   return("0Dh - MMM01+RAM+BATTERY");
+    case 0x0F:   return("0Fh - MBC3+TIMER+BATTERY");
+    case 0x10:   return("10h - MBC3+TIMER+RAM+BATTERY");
+    case 0x11:   return("11h - MBC3");
+    case 0x12:   return("12h - MBC3+RAM");
+    case 0x13:   return("13h - MBC3+RAM+BATTERY");
+    case 0x19:   return("19h - MBC5");
+    case 0x1A:   return("1Ah - MBC5+RAM");
+    case 0x1B:   return("1Bh - MBC5+RAM+BATTERY");
+    case 0x1C:   return("1Ch - MBC5+RUMBLE");
+    case 0x1D:   return("1Dh - MBC5+RUMBLE+RAM");
+    case 0x1E:   return("1Eh - MBC5+RUMBLE+RAM+BATTERY");
+    case 0x20:   return("20h - MBC6");
+    case 0x22:   return("22h - MBC7+SENSOR+RUMBLE+RAM+BATTERY");
+    case 0xFC:   return("FCh - POCKET CAMERA");
+    case 0xFD:   return("FDh - BANDAI TAMA5");
+    case 0xFE:   return("FEh - HuC3");
+    case 0xFF:   return("FFh - HuC1+RAM+BATTERY");
+    default:     break;
+  }
+  return("UNKNOW");
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static const char* print_rom_size(unsigned char rom_size)
+{
+  switch (rom_size) {
+    case 0x00:   return("00h - 32KByte(no ROM banking)");
+    case 0x01:   return("01h - 64KByte(4 banks)");
+    case 0x02:   return("02h - 128KByte(8 banks)");
+    case 0x03:   return("03h - 256KByte(16 banks)");
+    case 0x04:   return("04h - 512KByte(32 banks)");
+    case 0x05:   return("05h - 1MByte(64 banks) => only 63 banks used by MBC1");
+    case 0x06:   return("06h - 2MByte(128 banks) => only 125 banks used by MBC1");
+    case 0x07:   return("07h - 4MByte(256 banks)");
+    case 0x08:   return("08h - 8MByte(512 banks)");
+    case 0x52:   return("52h - 1.1MByte(72 banks)");
+    case 0x53:   return("53h - 1.2MByte(80 banks)");
+    case 0x54:   return("54h - 1.5MByte(96 banks)");
+    default:     break;
+  }
+  return("UNKNOW");
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static const char* print_ram_size(unsigned char ram_size)
+{
+  switch (ram_size) {
+    case 0x00:   return("00h - None");
+    case 0x01:   return("01h - 2 KBytes");
+    case 0x02:   return("02h - 8 Kbytes");
+    case 0x03:   return("03h - 32 KBytes(4 banks of 8KBytes each)");
+    case 0x04:   return("04h - 128 KBytes(16 banks of 8KBytes each)");
+    case 0x05:   return("05h - 64 KBytes(8 banks of 8KBytes each)");
+    default:     break;
+  }
+  return("UNKNOW");
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char send_packet_routine(HANDLE fd, unsigned char cmd)
+{
+  int i;
+  unsigned char tx_packet[7];
+
+  if (verbose) printf("send_packet_routine\n");
+
+  i = 0;
+  tx_packet[i++] = 0x10;
+  tx_packet[i++] = 0x02;
+  tx_packet[i++] = 0x00;
+  tx_packet[i++] = 0x00;
+  tx_packet[i++] = 0x00;
+  tx_packet[i++] = 0x01;
+  tx_packet[i++] = cmd;
+
+  if (verbose) print_packet(tx_packet, sizeof(tx_packet));
+  if (serial_write(fd, tx_packet, sizeof(tx_packet)) != sizeof(tx_packet)) {
+    printf("Error sending command: %s\n", strerror(errno));
+    return 1;
+  }
+
+  return 0;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char wait_ack(HANDLE fd, unsigned char code, unsigned long timeout)
+{
+  ssize_t ret;
+  unsigned char c;
+  unsigned char state;
+  unsigned long start;
+
+  /* Need: DLE + ACK/NAK + CODE */
+  state = 0;
+  start = get_time();
+  do {
+    ret = serial_read(fd, &c, 1);
+    if (ret <= 0) {
+      serial_wait(fd, POLL_INTERVAL);
+      continue;
+    }
+    switch (state) {
+      case 0:
+        if (c == 0x10) state = 1;
+        break;
+      case 1:
+        if (c == ACK) state = 2;
+        else if (c == NAK) state = 3;
+        else state = (c == 0x10) ? 1 : 0;
+        break;
+      case 2:
+        if (c == code) return 0;
+        printf("Unexpected ACK %02X (waiting %02X)\n", c, code);
+        return 2;
+      case 3:
+        printf("Command %02X refused (NAK %02X)\n", code, c);
+        return 3;
+    }
+  } while (!ctrlc && time_within(start, timeout));
+
+  if (ctrlc) return 1;
+  printf("TIMEOUT: no ACK for %02X\n", code);
+  return 4;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char wait_boot_banner(HANDLE fd)
+{
+  ssize_t ret;
+  unsigned char c;
+  unsigned char last;
+  unsigned char probed;
+  unsigned char answered;
+  unsigned int matched;
+  unsigned long start;
+  unsigned long idle;
+  const unsigned char banner[] = { 0x10, 0x02, 0x00, 0x00, 0x00, 0x04, 'G', 'B', 'x' };
+
+  /* Need: DLE + STX + SIZE(4) + "GBx" + VERSION */
+  matched = 0;
+  last = 0;
+  probed = 0;
+  answered = 0;
+  start = idle = get_time();
+  while (!ctrlc && ((get_time() - start) < BOOT_TIMEOUT)) {
+    ret = serial_read(fd, &c, 1);
+    if (ret <= 0) {
+      /* a quiet line may be a board that did not reset, the firmware NAKs the unused command 0x00 */
+      if (!probed && ((get_time() - idle) >= BOOT_PROBE_IDLE)) {
+        probed = 1;
+        if (send_packet_routine(fd, 0x00)) return 1;
+      }
+      serial_wait(fd, POLL_INTERVAL);
+      continue;
+    }
+    idle = get_time();
+    if (answered) {
+      /* code byte of the probe answer */
+      if (verbose) printf("Firmware answered the probe after %lu ms\n", get_time() - start);
+      return 0;
+    }
+    answered = probed && (last == 0x10) && ((c == ACK) || (c == NAK));
+    last = c;
+    if (matched == sizeof(banner)) {
+      if (verbose) printf("Firmware ready after %lu ms (protocol %d)\n", get_time() - start, c);
+      if (c != PROTOCOL_VERSION) printf("Warning: firmware protocol %d, expected %d\n", c, PROTOCOL_VERSION);
+      return 0;
+    }
+    if (c == banner[matched]) matched++;
+    else matched = (c == banner[0]) ? 1 : 0;
+  }
+
+  return 1;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char link_reset(HANDLE fd)
+{
+  /* same reset as opening the port on boards with auto-reset, the firmware starts over */
+  printf("Resetting the Arduino\n");
+  if (!replay.active) {
+    set_dtr(fd, 0);
+    sleep_us(100000);
+    set_dtr(fd, 1);
+    flush_serial(fd);
+  }
+  if (wait_boot_banner(fd)) {
+    printf("Arduino doesn't answer after reset\n");
+    return 1;
+  }
+
+  /* the bus timing profile is gone with the reset */
+  memset(timing_cart, 0, sizeof(timing_cart));
+  return 0;
+}
+
+static unsigned char link_recover(HANDLE fd)
+{
+  /* wait for a quiet line, a firmware which keeps sending is reset */
+  if (link_resync(fd) >= 0) return 0;
+  return link_reset(fd);
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char send_command(HANDLE fd, unsigned char cmd)
+{
+  unsigned char ret;
+  unsigned int attempt;
+  unsigned long long start;
+
+  /* firmware acknowledges before doing anything, so the ACK only costs the wire time */
+  for (attempt = 0; ; attempt++) {
+    flush_serial(fd);
+
+    start = get_time_us();
+    if (send_packet_routine(fd, cmd)) return 1;
+    ret = wait_ack(fd, cmd, link_timeout(7 + 3));
+    if (ret == 0) break;
+
+    /* only resend to a silent line, a firmware still busy with something is reset first */
+    if ((ret != 4) || (attempt == COMMAND_RETRIES)) return 2;
+    if (link_recover(fd)) return 2;
+    serial_link.retries++;
+    printf("Resending command %02X\n", cmd);
+  }
+  if (verbose) printf("Command %02X acknowledged in %.2f ms\n", cmd, (get_time_us() - start) / 1000.0);
+
+  return 0;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static ssize_t recv_packet_header_size(HANDLE fd)
+{
+  ssize_t ret;
+  ssize_t available;
+  unsigned char c;
+  unsigned char has_dle;
+  unsigned char has_stx;
+  unsigned long start;
+  unsigned long timeout;
+
+  if (verbose) printf("recv_packet_header_size\n");
+
+  /* receive the header of packet */
+  c = 0;
+  has_dle = 0;
+  has_stx = 0;
+  start = get_time();
+  do {
+    ret = serial_read(fd, &c, 1);
+    if (verbose && (ret > 0)) printf("RECEIVED 1: %X\n", c);
+    if (ret <= 0) serial_wait(fd, POLL_INTERVAL);
+  } while ((c != 0x10) && !ctrlc && time_valid(start));
+  c = 0;
+  ret = 0;
+  has_dle = 1;
+  /* the firmware may work before its reply, but the rest of the header follows DLE right away */
+  timeout = link_timeout(5);
+  start = get_time();
+  do {
+    ret = serial_read(fd, &c, 1);
+    if (ret <= 0) serial_wait(fd, POLL_INTERVAL);
+    if (ret > 0) {
+      if (verbose) printf("RECEIVED 2: %X\n", c);
+      if (c == 0x02) {
+        has_stx = 1;
+      }
+      break;
+    }
+  } while (!ctrlc && time_within(start, timeout));
+
+  if (ctrlc) return -1;
+  if (!has_dle || !has_stx) {
+    printf("TIMEOUT: DLE and/or STX not received!\n");
+    return -2;
+  }
+
+  /* receive the size */
+  available = -1;
+  {
+    ssize_t i = 0;
+    ssize_t j = 4;
+    unsigned char buff_size[4];
+    start = get_time();
+    do {
+      ret = serial_read(fd, buff_size + i, j);
+      if (ret <= 0) {
+        serial_wait(fd, POLL_INTERVAL);
+        continue;
+      }
+      i += ret;
+      j -= ret;
+    } while ((j > 0) && !ctrlc && time_within(start, timeout));
+    if (i == 4) {
+      available = long_from_array(buff_size);
+      if (verbose) printf("Received packet: %d %d %d %d => Total: %ld\n", buff_size[0], buff_size[1], buff_size[2], buff_size[3], available);
+    }
+  }
+
+  if (ctrlc) return -1;
+  if (available == -1) {
+    printf("Error receiving packet size\n");
+    return -3;
+  }
+
+  return available;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char recv_routine_buffer(HANDLE fd, ssize_t packet_size, unsigned char *out_buff, ssize_t out_buff_size, dump_digest *dg, unsigned char print_state)
+{
+  ssize_t ret;
+  ssize_t start;
+  ssize_t offset;
+  unsigned long timeout;
+  unsigned long long last = 0;
+  const ssize_t _packet_size = packet_size;
+
+  if (verbose) printf("recv_routine_buffer\n");
+
+  offset = 0;
+  timeout = link_timeout((packet_size < recv_chunk_size) ? packet_size : recv_chunk_size);
+  start = get_time();
+  do {
+    ret = serial_read(fd, out_buff + offset, packet_size);
+    if (ret > 0) {
+      if ((offset + ret) > out_buff_size) {
+        printf("Not enough space in buffer!\n");
+        return 4;
+      }
+      if (dg) digest_update(dg, out_buff + offset, ret);
+      offset += ret;
+      packet_size -= ret;
+      if (last) link_observe_gap(get_time_us() - last);
+      last = get_time_us();
+      timeout = link_timeout((packet_size < recv_chunk_size) ? packet_size : recv_chunk_size);
+      start = get_time();
+    }
+    else if (ret == 0) {
+      serial_wait(fd, POLL_INTERVAL);
+    }
+    else {
+      printf("Nasty: %s\n", strerror(errno));
+      return 3;
+    }
+    if (print_state) print_state_console(_packet_size, (_packet_size - packet_size));
+
+  } while ((packet_size > 0) && !ctrlc && time_within(start, timeout));
+  if (print_state) printf("\n");
+
+  if (ctrlc) return 1;
+  if (packet_size > 0) {
+    printf("ERROR: missing data!!! (nothing for %lu ms)\n", timeout);
+    serial_link.stalls++;
+    link_recover(fd);
+    return 2;
+  }
+
+  return 0;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char recv_routine_file(HANDLE fd, ssize_t packet_size, FILE *fp, dump_digest *dg, unsigned char print_state)
+{
+  ssize_t ret;
+  ssize_t start;
+  unsigned long timeout;
+  unsigned long long last = 0;
+  unsigned long long begin;
+  unsigned char rx_chunk[RECV_CHUNK_MAX];
+  const ssize_t _packet_size = packet_size;
+
+  if (verbose) printf("recv_routine_file\n");
+
+  timeout = link_timeout((packet_size < recv_chunk_size) ? packet_size : recv_chunk_size);
+  begin = get_time_us();
+  start = get_time();
+  do {
+    ret = serial_read(fd, rx_chunk, recv_chunk_size);
+    if (ret > 0) {
+      if (fwrite(rx_chunk, 1, ret, fp) != ret) {
+        printf("Error writing to file: %s\n", strerror(errno));
+        return 4;
+      }
+      if (dg) digest_update(dg, rx_chunk, ret);
+      packet_size -= ret;
+      if (last) link_observe_gap(get_time_us() - last);
+      last = get_time_us();
+      timeout = link_timeout((packet_size < recv_chunk_size) ? packet_size : recv_chunk_size);
+      start = get_time();
+    }
+    else if (ret == 0) {
+      serial_wait(fd, POLL_INTERVAL);
+    }
+    else {
+      printf("Nasty: %s\n", strerror(errno));
+      return 3;
+    }
+    if (print_state) print_state_console(_packet_size, (_packet_size - packet_size));
+    
+  } while ((packet_size > 0) && !ctrlc && time_within(start, timeout));
+  if (print_state) printf("\n");
+  
+  if (ctrlc) return 1;
+  if (packet_size > 0) {
+    printf("ERROR: missing data!!! (nothing for %lu ms)\n", timeout);
+    serial_link.stalls++;
+    link_recover(fd);
+    return 2;
+  }
+  if (verbose) {
+    printf("Received %ld bytes in %.1f ms (%.1f ms on the wire), gaps %lu us +/- %lu us\n", (long)_packet_size,
+           (get_time_us() - begin) / 1000.0, link_bytes_us(_packet_size) / 1000.0, serial_link.gap_us, serial_link.gap_dev_us);
+  }
+
+  return 0;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char recv_rom_map(HANDLE fd, unsigned long banks, FILE *fp, dump_digest *dg)
+{
+  ssize_t size;
+  unsigned long i;
+  unsigned long source;
+  unsigned long mirrors;
+  unsigned long blanks;
+  unsigned long real_banks;
+  long *bank_id;
+  unsigned char *frame;
+  unsigned char ret = 0;
+
+  if (verbose) printf("recv_rom_map\n");
+
+  frame = (unsigned char *)malloc(1 + 0x4000); // assume success
+  bank_id = (long *)malloc(banks * sizeof(long)); // assume success
+
+  /* bank_id is the first bank holding the same data, -1 when blank */
+  mirrors = 0;
+  blanks = 0;
+  for (i = 0; i < banks; i++) {
+    size = recv_packet_header_size(fd);
+    if (size < 0) {
+      ret = 1;
+      goto L_END_RECV_ROM_MAP;
+    }
+    if ((size < 1) || (size > (1 + 0x4000)) || recv_routine_buffer(fd, size, frame, 1 + 0x4000, NULL, 0)) {
+      printf("\nError receiving bank %lu\n", i);
+      ret = 2;
+      goto L_END_RECV_ROM_MAP;
+    }
+
+    if ((frame[0] == BANK_DATA) && (size == (1 + 0x4000))) {
+      bank_id[i] = i;
+    }
+    else if ((frame[0] == BANK_BLANK) && (size == 1)) {
+      memset(frame + 1, 0xFF, 0x4000);
+      bank_id[i] = -1;
+      blanks++;
+    }
+    else if ((frame[0] == BANK_MIRROR) && (size == 3) && ((source = ((unsigned long)frame[1] << 8) | frame[2]) < i)) {
+      /* copy it back from the part of the image already written */
+      if (fseek(fp, source * 0x4000L, SEEK_SET) || (fread(frame + 1, 1, 0x4000, fp) != 0x4000) || fseek(fp, 0, SEEK_END)) {
+        printf("\nError reading back bank %lu: %s\n", source, strerror(errno));
+        ret = 4;
+        goto L_END_RECV_ROM_MAP;
+      }
+      bank_id[i] = bank_id[source];
+      mirrors++;
+    }
+    else {
+      printf("\nError bad frame for bank %lu\n", i);
+      ret = 2;
+      goto L_END_RECV_ROM_MAP;
+    }
+
+    if (fwrite(frame + 1, 1, 0x4000, fp) != 0x4000) {
+      printf("\nError writing to file: %s\n", strerror(errno));
+      ret = 4;
+      goto L_END_RECV_ROM_MAP;
+    }
+    if (dg) digest_update(dg, frame + 1, 0x4000);
+    print_state_console((long)(banks * 0x4000), (long)((i + 1) * 0x4000));
+  }
+  printf("\n");
+
+  /* real size: smallest power of two the image repeats itself with */
+  for (real_banks = 2; real_banks < banks; real_banks <<= 1) {
+    for (i = real_banks; (i < banks) && (bank_id[i] == bank_id[i % real_banks]); i++);
+    if (i == banks) break;
+  }
+
+  printf("Banks: %lu unique, %lu mirrored, %lu blank\n", banks - mirrors - blanks, mirrors, blanks);
+  if (real_banks < banks) {
+    printf("Detected ROM size: %luKB (header says %luKB)\n", real_banks * 16, banks * 16);
+  }
+
+L_END_RECV_ROM_MAP:
+  free(bank_id);
+  free(frame);
+  return ret;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static size_t file_source_read(void *ctx, unsigned char *buf, size_t len)
+{
+  return fread(buf, 1, len, (FILE *)ctx);
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char send_routine_source(HANDLE fd, const tx_source *src, ssize_t file_size, unsigned char ack_code, unsigned char print_state)
+{
+  ssize_t current_size = 0;
+  unsigned int in_flight = 0;
+  unsigned char ack_error = 0;
+  unsigned char tx_chunk[SEND_CHUNK_SIZE];
+
+  if (verbose) printf("send_routine_source\n");
+
+  do {
+    if (src->read(src->ctx, tx_chunk, SEND_CHUNK_SIZE) != SEND_CHUNK_SIZE) {
+      printf("Error reading data: %s\n", strerror(errno));
+      break;
+    }
+    if (serial_write(fd, tx_chunk, SEND_CHUNK_SIZE) != SEND_CHUNK_SIZE) {
+      printf("Error sending packet: %s\n", strerror(errno));
+      break;
+    }
+    current_size += SEND_CHUNK_SIZE;
+    /* firmware acknowledges every chunk once it left its RX buffer */
+    if (++in_flight == SEND_WINDOW) {
+      if ((ack_error = wait_ack(fd, ack_code, link_timeout(SEND_CHUNK_SIZE * SEND_WINDOW)))) break;
+      in_flight--;
+    }
+    if (print_state) print_state_console(file_size, current_size);
+  } while (!ctrlc && (current_size < file_size));
+  while (!ctrlc && !ack_error && (in_flight > 0)) {
+    if ((ack_error = wait_ack(fd, ack_code, link_timeout(SEND_CHUNK_SIZE * SEND_WINDOW)))) break;
+    in_flight--;
+  }
+  if (print_state) printf("\n");
+
+  if (ctrlc) return 1;
+  if ((current_size < file_size) || (in_flight > 0)) {
+    printf("ERROR: missing data!!!\n");
+    return 2;
+  }
+
+  return 0;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char send_routine_file(HANDLE fd, FILE *fp, ssize_t file_size, unsigned char ack_code, unsigned char print_state)
+{
+  tx_source src;
+  src.read = file_source_read;
+  src.ctx = fp;
+  return send_routine_source(fd, &src, file_size, ack_code, print_state);
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+/* returns 0 when the RAM matches or the verify was skipped */
+static unsigned char verify_ram(HANDLE fd, FILE *fp, unsigned long ram_size)
+{
+  unsigned char result = 1;
+  unsigned char *RAM_read;
+  unsigned char *RAM_file;
+
+  if (verbose) printf("verify_ram\n");
+
+  printf("Verify RAM?[y/n]? ");
+  if (!read_yes_no()) return 0;
+  printf("Reading RAM\n");
+
+  if (send_command(fd, READ_RAM_COMMAND)) return 1;
+
+  /* UGLY => TODO: compare chunks of data */
+  RAM_read = (unsigned char *)malloc(ram_size); // assume success
+  RAM_file = (unsigned char *)malloc(ram_size); // assume success
+
+  /* go back to begin of file */
+  rewind(fp);
+  fread(RAM_file, 1, ram_size, fp); // assume success
+
+  if (recv_packet_header_size(fd) == ram_size) {
+    if (recv_routine_buffer(fd, ram_size, RAM_read, ram_size, NULL, verbose) == 0) {
+      if (memcmp(RAM_read, RAM_file, ram_size) != 0) {
+        printf("=> RAM NOK(possibly corrupted)!\n");
+      }
+      else {
+        printf("=> RAM OK!\n");
+        result = 0;
+      }
+    }
+    else {
+      printf("=> Error with RAM, try again\n");
+    }
+  }
+  else {
+    printf("=> Error with RAM, try again\n");
+  }
+
+  free(RAM_file);
+  free(RAM_read);
+
+  return result;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+/* station mode: finished dumps are hashed, archived and catalogued by workers
+ * while the link is already busy with the next transfer */
+#define STATION_WORKERS       ( 2   )
+#define STATION_POLL          ( 500 ) /* milliseconds between INFO polls */
+#define STATION_POLL_ERRORS   ( 2   ) /* failed polls in a row before the station stops */
+#define STATION_CATALOG       "gbx-station.log"
+
+typedef struct station_job {
+  char path[32];
+  char title[16];
+  char kind;
+  unsigned char running;
+  char report[160];               /* formatted by the worker, without the errors */
+  int open_error;                 /* errno values, strerror is left to the main thread */
+  int manifest_error;
+  int catalog_error;
+  archive_result archived;
+  struct station_job *next;
+} station_job;
+
+static struct {
+  unsigned char active;
+  unsigned char stop;
+  unsigned int workers_count;
+  thread_t workers[STATION_WORKERS];
+  mutex_t lock;                   /* queue, done and counters */
+  mutex_t files_lock;             /* archive and catalog */
+  cond_t changed;
+  station_job *queue;             /* oldest first, waiting or running */
+  station_job *done;              /* reports not printed yet */
+  unsigned long submitted;
+  unsigned long finished;
+} station;
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void station_process(station_job *job)
+{
+  FILE *fp;
+  FILE *catalog;
+  int i;
+  int n;
+  size_t len;
+  ssize_t file_size;
+  time_t now;
+  struct tm now_tm;
+  dump_digest dg;
+  char when[32];
+  unsigned char *chunk;
+  unsigned char is_rom = (job->kind == ARCHIVE_KIND_ROM);
+  unsigned long long start = get_time_us();
+
+  if (get_file_size(job->path, &file_size) || !(fp = fopen(job->path, "rb"))) {
+    job->open_error = errno;
+    return;
+  }
+
+  chunk = (unsigned char *)malloc(0x4000); // assume success
+  digest_init(&dg, file_size, is_rom ? 0x4000 : 0x2000, is_rom);
+  while ((len = fread(chunk, 1, 0x4000, fp)) > 0) digest_update(&dg, chunk, len);
+  digest_final(&dg);
+  free(chunk);
+  fclose(fp);
+
+  job->manifest_error = write_manifest(&dg, job->path);
+
+  n = snprintf(job->report, sizeof(job->report), "%s: CRC32 %08lx SHA-1 ", job->path, dg.crc32);
+  for (i = 0; i < 20; i++) n += snprintf(job->report + n, sizeof(job->report) - n, "%02x", dg.sha1_sum[i]);
+  if (is_rom) n += snprintf(job->report + n, sizeof(job->report) - n, ", checksum %s", (dg.global_sum == dg.global_expected) ? "OK" : "NOK");
+
+  mutex_lock(&station.files_lock);
+  if (archive_dumps) archive_store_file(job->path, job->title, job->kind, &job->archived);
+
+  /* catalog: DATE TIME, KIND, TITLE, FILE, SIZE, CRC32, SHA-1, CHECKSUM separated by tabs */
+  catalog = fopen(STATION_CATALOG, "a");
+  if (catalog) {
+    now = time(NULL);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &now_tm));
+    fprintf(catalog, "%s\t%c\t%s\t%s\t%ld\t%08lx\t", when, job->kind, job->title, job->path, (long)file_size, dg.crc32);
+    print_hex(catalog, dg.sha1_sum, 20);
+    fprintf(catalog, "\t%s\n", is_rom ? ((dg.global_sum == dg.global_expected) ? "OK" : "NOK") : "-");
+    fclose(catalog);
+  }
+  else {
+    job->catalog_error = errno;
+  }
+  mutex_unlock(&station.files_lock);
+
+  snprintf(job->report + n, sizeof(job->report) - n, " (%.0f ms)", (get_time_us() - start) / 1000.0);
+  digest_free(&dg);
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static THREAD_FUNC(station_worker, arg)
+{
+  station_job *job;
+  station_job **pos;
+
+  (void)arg;
+
+  mutex_lock(&station.lock);
+  for (;;) {
+    for (job = station.queue; job && job->running; job = job->next);
+    if (!job) {
+      if (station.stop) break;
+      cond_wait(&station.changed, &station.lock);
+      continue;
+    }
+
+    job->running = 1;
+    mutex_unlock(&station.lock);
+    station_process(job);
+    mutex_lock(&station.lock);
+
+    /* move it to the reports, in order of completion */
+    for (pos = &station.queue; *pos != job; pos = &(*pos)->next);
+    *pos = job->next;
+    job->next = NULL;
+    for (pos = &station.done; *pos; pos = &(*pos)->next);
+    *pos = job;
+    station.finished++;
+    cond_broadcast(&station.changed);
+  }
+  mutex_unlock(&station.lock);
+
+  THREAD_RETURN;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void station_submit(const char *path, char kind)
+{
+  station_job *job;
+  station_job **pos;
+
+  job = (station_job *)calloc(1, sizeof(station_job)); // assume success
+  strncpy(job->path, path, sizeof(job->path) - 1);
+  memcpy(job->title, rom_title, sizeof(job->title));
+  job->kind = kind;
+
+  mutex_lock(&station.lock);
+  for (pos = &station.queue; *pos; pos = &(*pos)->next);
+  *pos = job;
+  station.submitted++;
+  cond_broadcast(&station.changed);
+  mutex_unlock(&station.lock);
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void station_wait_path(const char *path)
+{
+  station_job *job;
+
+  /* same title again, don't overwrite a file a worker is still reading */
+  mutex_lock(&station.lock);
+  for (;;) {
+    for (job = station.queue; job && strcmp(job->path, path); job = job->next);
+    if (!job) break;
+    cond_wait(&station.changed, &station.lock);
+  }
+  mutex_unlock(&station.lock);
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void station_print_reports()
+{
+  station_job *job;
+  station_job *list;
+
+  mutex_lock(&station.lock);
+  list = station.done;
+  station.done = NULL;
+  mutex_unlock(&station.lock);
+
+  while (list) {
+    if (list->open_error) {
+      printf("Processed %s: error openning: %s\n", list->path, strerror(list->open_error));
+    }
+    else {
+      printf("Processed %s", list->report);
+      if (list->manifest_error) printf(", no manifest: %s", strerror(list->manifest_error));
+      if (list->catalog_error) printf(", not catalogued: %s", strerror(list->catalog_error));
+      printf("\n");
+      print_archive_result(list->path, &list->archived);
+    }
+    job = list;
+    list = list->next;
+    free(job);
+  }
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char station_start()
+{
+  unsigned int i;
+
+  memset(&station, 0, sizeof(station));
+  mutex_init(&station.lock);
+  mutex_init(&station.files_lock);
+  cond_init(&station.changed);
+
+  for (i = 0; i < STATION_WORKERS; i++) {
+    if (thread_start(&station.workers[i], station_worker, NULL)) {
+      printf("Error starting worker %u\n", i);
+      break;
+    }
+    station.workers_count++;
+  }
+
+  /* without workers the dumps are processed inline, as from the menu */
+  station.active = (station.workers_count > 0);
+  return !station.active;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned long station_pending()
+{
+  unsigned long pending;
+
+  mutex_lock(&station.lock);
+  pending = station.submitted - station.finished;
+  mutex_unlock(&station.lock);
+
+  return pending;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void station_stop()
+{
+  unsigned int i;
+
+  if (station_pending()) printf("Waiting for %lu jobs\n", station_pending());
+
+  mutex_lock(&station.lock);
+  station.stop = 1;
+  cond_broadcast(&station.changed);
+  mutex_unlock(&station.lock);
+
+  /* workers empty the queue before leaving */
+  for (i = 0; i < station.workers_count; i++) thread_join(station.workers[i]);
+  station_print_reports();
+
+  cond_destroy(&station.changed);
+  mutex_destroy(&station.files_lock);
+  mutex_destroy(&station.lock);
+  station.active = 0;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char validate_header_checksum()
+{
+  int i;
+  unsigned char checksum = 0;
+  for (i = 0x0134; i < 0x014D; i++) {
+    checksum = checksum - header_byte(i) - 1;
+  }
+  return (checksum == header_byte(0x014D));
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char get_info(HANDLE fd)
+{
+  ssize_t size;
+  unsigned char *sizes;
+  unsigned char info[INFO_PACKET_SIZE];
+  unsigned long long start;
+
+  if (verbose) printf("get_info\n");
+
+  start = get_time_us();
+
+  if (send_command(fd, INFO_COMMAND)) return 1;
+
+  size = recv_packet_header_size(fd);
+  if (size != INFO_PACKET_SIZE) {
+    /* older firmware answers with an empty packet */
+    printf("Error got no info packet!\n");
+    return 2;
+  }
+
+  if (recv_routine_buffer(fd, size, info, sizeof(info), NULL, 0)) return 3;
+
+  memcpy(cart_info.header, info, INFO_HEADER_SIZE);
+  sizes = info + INFO_HEADER_SIZE;
+  cart_info.rom_size = long_from_array(sizes);
+  sizes += 4;
+  cart_info.ram_size = long_from_array(sizes);
+  cart_info.protocol = info[INFO_HEADER_SIZE + 8];
+  cart_info.capabilities = (info[INFO_HEADER_SIZE + 9] << 8) | info[INFO_HEADER_SIZE + 10];
+
+  if (verbose) {
+    printf("Info received in %.2f ms\n", (get_time_us() - start) / 1000.0);
+    printf("Protocol version: %d\n", cart_info.protocol);
+    printf("Capabilities: %04X\n", cart_info.capabilities);
+    printf("ROM size: %ld, RAM size: %ld\n", cart_info.rom_size, cart_info.ram_size);
+  }
+
+  return 0;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void read_header(HANDLE fd, unsigned char to_print)
+{
+  if (verbose) printf("read_header\n");
+
+  memset(&cart_info, 0, sizeof(cart_info));
+
+  if (get_info(fd)) goto L_END_READ_HEADER;
+
+  if (validate_header_checksum()) {
+    memcpy(rom_title, &header_byte(0x0134), 15);
+    rom_title[15] = '\0';
+    if (to_print) {
+      printf("Rom title: %s\n", rom_title);
+      printf("Cartridge type: %s\n", print_cartridge_string(header_byte(0x0147)));
+      printf("Rom size: %s\n", print_rom_size(header_byte(0x0148)));
+      printf("Ram size: %s\n", print_ram_size(header_byte(0x0149)));
+      printf("Rom version: %d\n", header_byte(0x014C));
+      printf("Checksum: %d\n", header_byte(0x014D));
+    }
+  }
+  else {
+    printf("No cartridge inserted or cartridge read failed!\n");
+  }
+
+L_END_READ_HEADER:
+  if (to_print) printf("\n");
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char calibrate_bus(HANDLE fd)
+{
+  unsigned char reply[3];
+
+  if (verbose) printf("calibrate_bus\n");
+
+  /* Need: PROFILE + FASTEST + STABLE */
+  if (send_command(fd, CALIBRATE_COMMAND)) return 1;
+  if ((recv_packet_header_size(fd) != sizeof(reply)) || recv_routine_buffer(fd, sizeof(reply), reply, sizeof(reply), NULL, 0)) {
+    printf("Error receiving bus calibration\n");
+    return 2;
+  }
+  memcpy(timing_cart, &header_byte(0x014D), sizeof(timing_cart));
+
+  if (!reply[2]) {
+    printf("Bus timing: reads not reproducible, using profile %d (~%.0f ns)\n", reply[0], bus_delay_ns(reply[0]));
+    return 3;
+  }
+  printf("Bus timing: profile %d (~%.0f ns), fastest matching %d\n", reply[0], bus_delay_ns(reply[0]), reply[1]);
+
+  return 0;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void read_rom(HANDLE fd)
+{
+  int i;
+  int err;
+  FILE *fp;
+  ssize_t size;
+  unsigned char mapped;
+  unsigned char to_archive = 0;
+  unsigned char to_station = 0;
+  char rom_filename[32];
+  archive_result archived;
+
+  if (verbose) printf("read_rom\n");
+
+  if (rom_title[0] == 0) {
+    printf("Error no cartridge info\n");
+    goto L_END_READ_ROM;
+  }
+
+  i = strlen(rom_title);
+  memcpy(rom_filename, rom_title, i + 1);
+  rom_filename[i++] = '.';
+  rom_filename[i++] = 'g';
+  rom_filename[i++] = 'b';
+  rom_filename[i++] = '\0';
+
+  /* new cartridge, find its fastest reliable timing before the long transfer */
+  if ((cart_info.capabilities & CAP_BUS_TIMING) && memcmp(timing_cart, &header_byte(0x014D), sizeof(timing_cart))) {
+    calibrate_bus(fd);
+  }
+
+  printf("Reading ROM and saving to %s\n", rom_filename);
+
+  if (station.active) station_wait_path(rom_filename);
+
+  /* mirrors are rebuilt from the file, so it's also read */
+  fp = fopen(rom_filename, "w+b");
+  if (!fp) {
+    printf("Error creating %s: %s\n", rom_filename, strerror(errno));
+    goto L_END_READ_ROM;
+  }
+
+  /* the mapped dump only transfers banks that aren't mirrors or blank */
+  mapped = (cart_info.capabilities & CAP_BANK_MAP) ? 1 : 0;
+  if (send_command(fd, mapped ? READ_ROM_MAP_COMMAND : READ_ROM_COMMAND)) {
+    fclose(fp);
+    goto L_END_READ_ROM;
+  }
+
+  size = recv_packet_header_size(fd);
+  if (mapped && (size > 0)) {
+    unsigned char count[2];
+    if ((size == 2) && (recv_routine_buffer(fd, 2, count, 2, NULL, 0) == 0)) {
+      size = (((unsigned long)count[0] << 8) | count[1]) * 0x4000L;
+    }
+    else {
+      size = -1;
+    }
+  }
+  if ((size > 0) && station.active) {
+    /* hashing, manifest and archive are done by a station worker */
+    if ((mapped ? recv_rom_map(fd, size / 0x4000, fp, NULL) : recv_routine_file(fd, size, fp, NULL, 1)) == 0) {
+      to_station = 1;
+    }
+  }
+  else if (size > 0) {
+    dump_digest dg;
+    digest_init(&dg, size, 0x4000, 1);
+    if ((mapped ? recv_rom_map(fd, size / 0x4000, fp, &dg) : recv_routine_file(fd, size, fp, &dg, 1)) == 0) {
+      digest_final(&dg);
+      print_digest(&dg);
+      if ((err = write_manifest(&dg, rom_filename))) printf("Error creating %s.manifest: %s\n", rom_filename, strerror(err));
+      to_archive = archive_dumps;
+    }
+    digest_free(&dg);
+  }
+  else {
+    /* We must have size */
+    printf("Error got no packet size!\n");
+  }
+
+  fclose(fp);
+
+  if (to_station) station_submit(rom_filename, ARCHIVE_KIND_ROM);
+  if (to_archive) {
+    archive_store_file(rom_filename, rom_title, ARCHIVE_KIND_ROM, &archived);
+    print_archive_result(rom_filename, &archived);
+  }
+
+L_END_READ_ROM:
+  printf("\n");
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void read_ram(HANDLE fd)
+{
+  int i;
+  int err;
+  FILE *fp;
+  ssize_t size;
+  unsigned char to_archive = 0;
+  unsigned char to_station = 0;
+  char ram_filename[32];
+  archive_result archived;
+
+  if (verbose) printf("read_ram\n");
+
+  if (rom_title[0] == 0) {
+    printf("Error no cartridge info\n");
+    goto L_END_READ_RAM;
+  }
+
+  i = strlen(rom_title);
+  memcpy(ram_filename, rom_title, i + 1);
+  ram_filename[i++] = '.';
+  ram_filename[i++] = 's';
+  ram_filename[i++] = 'a';
+  ram_filename[i++] = 'v';
+  ram_filename[i++] = '\0';
+
+  printf("Reading RAM and saving to %s\n", ram_filename);
+
+  if (station.active) station_wait_path(ram_filename);
+
+  fp = fopen(ram_filename, "wb");
+  if (!fp) {
+    printf("Error creating %s: %s\n", ram_filename, strerror(errno));
+    goto L_END_READ_RAM;
+  }
+
+  if (send_command(fd, READ_RAM_COMMAND)) {
+    fclose(fp);
+    goto L_END_READ_RAM;
+  }
+
+  size = recv_packet_header_size(fd);
+  if ((size > 0) && station.active) {
+    /* hashing, manifest and archive are done by a station worker */
+    if (recv_routine_file(fd, size, fp, NULL, 1) == 0) to_station = 1;
+  }
+  else if (size > 0) {
+    dump_digest dg;
+    digest_init(&dg, size, 0x2000, 0);
+    if (recv_routine_file(fd, size, fp, &dg, 1) == 0) {
+      digest_final(&dg);
+      print_digest(&dg);
+      if ((err = write_manifest(&dg, ram_filename))) printf("Error creating %s.manifest: %s\n", ram_filename, strerror(err));
+      to_archive = archive_dumps;
+    }
+    digest_free(&dg);
+  }
+  else {
+    /* We must have size */
+    printf("Error got no packet size!\n");
+  }
+
+  fclose(fp);
+
+  if (to_station) station_submit(ram_filename, ARCHIVE_KIND_SAVE);
+  if (to_archive) {
+    archive_store_file(ram_filename, rom_title, ARCHIVE_KIND_SAVE, &archived);
+    print_archive_result(ram_filename, &archived);
+  }
+
+L_END_READ_RAM:
+  printf("\n");
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char write_ram(HANDLE fd)
+{
+  FILE *fp;
+  ssize_t ram_size;
+  unsigned char result = 1;
+  char ram_filename[32];
+
+  if (verbose) printf("write_ram\n");
+
+  if (rom_title[0] == 0) {
+    printf("Error no cartridge info\n");
+    goto L_END_WRITE_RAM;
+  }
+
+  ram_size = cart_info.ram_size;
+  if (ram_size == 0) {
+    printf("Cartridge has no RAM\n");
+    goto L_END_WRITE_RAM;
+  }
+
+  if (ram_size > 0) {
+    int i;
+    ssize_t compare_size;
+
+    i = strlen(rom_title);
+    memcpy(ram_filename, rom_title, i + 1);
+    ram_filename[i++] = '.';
+    ram_filename[i++] = 's';
+    ram_filename[i++] = 'a';
+    ram_filename[i++] = 'v';
+    ram_filename[i++] = '\0';
+
+    if (get_file_size(ram_filename, &compare_size)) {
+      printf("No file found or couldn't open file\n");
+      goto L_END_WRITE_RAM;
+    }
+    if (ram_size != compare_size) {
+      printf("RAM file cannot be used!\n");
+      goto L_END_WRITE_RAM;
+    }
+
+    printf("Use RAM file %s[y/n]? ", ram_filename);
+    if (!read_yes_no()) {
+      printf("No action done!\n");
+      goto L_END_WRITE_RAM;
+    }
+  }
+
+  fp = fopen(ram_filename, "rb");
+  if (!fp) {
+    printf("Error openning %s: %s\n", ram_filename, strerror(errno));
+    goto L_END_WRITE_RAM;
+  }
+
+  if (send_command(fd, WRITE_RAM_COMMAND)) {
+    fclose(fp);
+    goto L_END_WRITE_RAM;
+  }
+
+  if (send_routine_file(fd, fp, ram_size, WRITE_RAM_COMMAND, 1)) {
+    fclose(fp);
+    goto L_END_WRITE_RAM;
+  }
+
+  result = verify_ram(fd, fp, ram_size);
+
+  fclose(fp);
+
+L_END_WRITE_RAM:
+  printf("\n");
+  return result;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void restore_ram(HANDLE fd)
+{
+  char *end;
+  char line[16];
+  char when[32];
+  unsigned long i;
+  unsigned long count;
+  unsigned long choice;
+  unsigned long bad_blocks;
+  unsigned char *RAM_read;
+  tx_source src;
+  archive_reader rd;
+  archive_snapshot snapshots[ARCHIVE_LIST_MAX];
+
+  if (verbose) printf("restore_ram\n");
+
+  if (rom_title[0] == 0) {
+    printf("Error no cartridge info\n");
+    goto L_END_RESTORE_RAM;
+  }
+  if (cart_info.ram_size == 0) {
+    printf("Cartridge has no RAM\n");
+    goto L_END_RESTORE_RAM;
+  }
+
+  count = archive_list(rom_title, ARCHIVE_KIND_SAVE, cart_info.ram_size, snapshots, ARCHIVE_LIST_MAX);
+  if (count == 0) {
+    printf("No archived saves for %s\n", rom_title);
+    goto L_END_RESTORE_RAM;
+  }
+  for (i = 0; i < count; i++) {
+    time_t t = (time_t)snapshots[i].time;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("%lu) %s\n", i, when);
+  }
+  printf("Restore which save? ");
+  if (!fgets(line, sizeof(line), stdin)) goto L_END_RESTORE_RAM;
+  choice = strtoul(line, &end, 10);
+  if ((end == line) || (choice >= count)) {
+    printf("Invalid option\n");
+    goto L_END_RESTORE_RAM;
+  }
+
+  printf("Write save to cartridge[y/n]? ");
+  if (!read_yes_no()) {
+    printf("No action done!\n");
+    goto L_END_RESTORE_RAM;
+  }
+
+  if (archive_reader_open(&rd, &snapshots[choice])) goto L_CLOSE_RESTORE_RAM;
+
+  if (send_command(fd, WRITE_RAM_COMMAND)) goto L_CLOSE_RESTORE_RAM;
+
+  /* blocks are decompressed as the link asks for them */
+  src.read = archive_reader_read;
+  src.ctx = &rd;
+  if (send_routine_source(fd, &src, cart_info.ram_size, WRITE_RAM_COMMAND, 1)) goto L_CLOSE_RESTORE_RAM;
+
+  printf("Verify RAM?[y/n]? ");
+  if (!read_yes_no()) goto L_CLOSE_RESTORE_RAM;
+  printf("Reading RAM\n");
+
+  if (send_command(fd, READ_RAM_COMMAND)) goto L_CLOSE_RESTORE_RAM;
+
+  RAM_read = (unsigned char *)malloc(cart_info.ram_size); // assume success
+  if ((recv_packet_header_size(fd) == (ssize_t)cart_info.ram_size) &&
+      (recv_routine_buffer(fd, cart_info.ram_size, RAM_read, cart_info.ram_size, NULL, verbose) == 0)) {
+    /* compare with the snapshot block hashes */
+    bad_blocks = 0;
+    for (i = 0; i < rd.blocks; i++) {
+      sha1_ctx ctx;
+      unsigned char sha1[20];
+      unsigned long len = cart_info.ram_size - (i * ARCHIVE_BLOCK_SIZE);
+      if (len > ARCHIVE_BLOCK_SIZE) len = ARCHIVE_BLOCK_SIZE;
+      sha1_init(&ctx);
+      sha1_update(&ctx, RAM_read + (i * ARCHIVE_BLOCK_SIZE), len);
+      sha1_final(&ctx, sha1);
+      if (memcmp(sha1, rd.hashes + (i * 20), 20)) bad_blocks++;
+    }
+    if (bad_blocks) {
+      printf("=> RAM NOK(possibly corrupted)!\n");
+    }
     else {
-      printf("Nasty: %s\n", strerror(errno));
-      return 3;
+      printf("=> RAM OK!\n");
     }
-    if (print_state) print_state_console(_packet_size, (_packet_size - packet_size));
+  }
+  else {
+    printf("=> Error with RAM, try again\n");
+  }
+  free(RAM_read);
 
-  } while ((packet_size > 0) && !ctrlc && time_valid(start));
-  if (print_state) printf("\n");
+L_CLOSE_RESTORE_RAM:
+  archive_reader_close(&rd);
 
-  if (ctrlc) return 1;
-  if (packet_size > 0) {
-    printf("ERROR: missing data!!!\n");
+L_END_RESTORE_RAM:
+  printf("\n");
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+/* random access view of the inserted cartridge, banks are fetched page by page
+ * with range reads and kept in a small LRU cache */
+#define VIEW_CACHE_BANKS      ( 8    )
+#define VIEW_PAGE_SIZE        ( 256  ) /* 64 pages per ROM bank, one valid bit each */
+#define INSPECT_MAX_LENGTH    ( 4096 )
+
+typedef struct {
+  unsigned char used;
+  unsigned char area;
+  unsigned short bank;
+  unsigned long long valid;
+  unsigned long last_use;
+  unsigned char data[0x4000];
+} view_slot;
+
+typedef struct {
+  HANDLE fd;
+  unsigned long tick;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long fetched;
+  view_slot slots[VIEW_CACHE_BANKS];
+} cart_view;
+
+#define view_page_bit(P)      ( 1ULL << (P) )
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned long view_bank_size(unsigned char area)
+{
+  if (area == AREA_ROM) return 0x4000;
+  return (cart_info.ram_size < 0x2000) ? cart_info.ram_size : 0x2000;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void cart_view_init(cart_view *view, HANDLE fd)
+{
+  memset(view, 0, sizeof(cart_view));
+  view->fd = fd;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void cart_view_invalidate(cart_view *view)
+{
+  int i;
+  for (i = 0; i < VIEW_CACHE_BANKS; i++) {
+    view->slots[i].used = 0;
+    view->slots[i].valid = 0;
+  }
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static view_slot* view_get_slot(cart_view *view, unsigned char area, unsigned short bank)
+{
+  int i;
+  view_slot *slot = &view->slots[0];
+
+  for (i = 0; i < VIEW_CACHE_BANKS; i++) {
+    if (view->slots[i].used && (view->slots[i].area == area) && (view->slots[i].bank == bank)) return &view->slots[i];
+  }
+
+  /* free slot or least recently used */
+  for (i = 0; i < VIEW_CACHE_BANKS; i++) {
+    if (!view->slots[i].used) {
+      slot = &view->slots[i];
+      break;
+    }
+    if (view->slots[i].last_use < slot->last_use) slot = &view->slots[i];
+  }
+  slot->used = 1;
+  slot->area = area;
+  slot->bank = bank;
+  slot->valid = 0;
+
+  return slot;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char view_fetch(cart_view *view, view_slot *slot, unsigned long first_page, unsigned long pages)
+{
+  unsigned long i;
+  unsigned long offset = first_page * VIEW_PAGE_SIZE;
+  unsigned long length = pages * VIEW_PAGE_SIZE;
+  unsigned char params[7];
+
+  if (verbose) printf("view_fetch\n");
+
+  if ((offset + length) > view_bank_size(slot->area)) length = view_bank_size(slot->area) - offset;
+
+  /* Need: AREA + BANK(2) + OFFSET(2) + LENGTH(2) */
+  params[0] = slot->area;
+  params[1] = (slot->bank >> 8) & 0xFF;
+  params[2] = slot->bank & 0xFF;
+  params[3] = (offset >> 8) & 0xFF;
+  params[4] = offset & 0xFF;
+  params[5] = (length >> 8) & 0xFF;
+  params[6] = length & 0xFF;
+
+  if (send_command(view->fd, READ_RANGE_COMMAND)) return 1;
+  if (serial_write(view->fd, params, sizeof(params)) != sizeof(params)) {
+    printf("Error sending packet: %s\n", strerror(errno));
     return 2;
   }
+  if (recv_packet_header_size(view->fd) != (ssize_t)length) {
+    printf("Error range not available\n");
+    return 3;
+  }
+  if (recv_routine_buffer(view->fd, length, slot->data + offset, length, NULL, 0)) return 4;
+
+  for (i = 0; i < pages; i++) slot->valid |= view_page_bit(first_page + i);
+  view->fetched += length;
+
+  return 0;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char cart_view_read(cart_view *view, unsigned char area, unsigned long address, unsigned char *out, unsigned long len)
+{
+  unsigned long n;
+  unsigned long page;
+  unsigned long last;
+  unsigned long next;
+  unsigned long offset;
+  unsigned long bank_size = view_bank_size(area);
+  unsigned char missed;
+  view_slot *slot;
+
+  if ((bank_size == 0) || ((address + len) > ((area == AREA_ROM) ? cart_info.rom_size : cart_info.ram_size))) return 1;
+
+  while (len > 0) {
+    offset = address % bank_size;
+    n = bank_size - offset;
+    if (n > len) n = len;
+
+    slot = view_get_slot(view, area, address / bank_size);
+
+    /* each run of missing pages is one range read */
+    missed = 0;
+    last = (offset + n - 1) / VIEW_PAGE_SIZE;
+    for (page = offset / VIEW_PAGE_SIZE; page <= last; page = next) {
+      next = page + 1;
+      if (slot->valid & view_page_bit(page)) continue;
+      while ((next <= last) && !(slot->valid & view_page_bit(next))) next++;
+      if (view_fetch(view, slot, page, next - page)) {
+        slot->used = 0;
+        return 2;
+      }
+      missed = 1;
+    }
+    if (missed) view->misses++;
+    else view->hits++;
+    slot->last_use = ++view->tick;
+
+    memcpy(out, slot->data + offset, n);
+    out += n;
+    address += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void inspect_cartridge(HANDLE fd)
+{
+  char line[64];
+  char area_name[4];
+  unsigned char area;
+  unsigned char data[INSPECT_MAX_LENGTH];
+  unsigned long i;
+  unsigned long j;
+  unsigned long len;
+  unsigned long address;
+  unsigned long long start;
+  cart_view *view;
+
+  if (verbose) printf("inspect_cartridge\n");
+
+  if (rom_title[0] == 0) {
+    printf("Error no cartridge info\n");
+    goto L_END_INSPECT_CARTRIDGE;
+  }
+  if (!(cart_info.capabilities & CAP_RANGE_READ)) {
+    printf("Firmware doesn't support range reads, update it\n");
+    goto L_END_INSPECT_CARTRIDGE;
+  }
+
+  view = (cart_view *)malloc(sizeof(cart_view)); // assume success
+  cart_view_init(view, fd);
+
+  printf("Read with: rom|ram ADDRESS LENGTH (hex), empty line to stop\n");
+  while (!ctrlc) {
+    printf("> ");
+    if (!fgets(line, sizeof(line), stdin) || (line[0] == '\n')) break;
+    if ((sscanf(line, "%3s %lx %lx", area_name, &address, &len) != 3) || (len == 0) || (len > INSPECT_MAX_LENGTH) ||
+        (strcmp(area_name, "rom") && strcmp(area_name, "ram"))) {
+      printf("Invalid range\n");
+      continue;
+    }
+    area = strcmp(area_name, "rom") ? AREA_RAM : AREA_ROM;
+
+    start = get_time_us();
+    if (cart_view_read(view, area, address, data, len)) {
+      printf("Error reading %s 0x%lX-0x%lX\n", area_name, address, address + len - 1);
+      continue;
+    }
+
+    for (i = 0; i < len; i += 16) {
+      printf("%06lX ", address + i);
+      for (j = i; j < (i + 16); j++) {
+        if (j < len) printf(" %02X", data[j]);
+        else printf("   ");
+      }
+      printf("  ");
+      for (j = i; (j < (i + 16)) && (j < len); j++) printf("%c", ((data[j] >= 0x20) && (data[j] < 0x7F)) ? data[j] : '.');
+      printf("\n");
+    }
+    printf("%.2f ms, cache hits: %lu, misses: %lu, fetched: %lu bytes\n", (get_time_us() - start) / 1000.0, view->hits, view->misses, view->fetched);
+  }
+
+  cart_view_invalidate(view);
+  free(view);
+
+L_END_INSPECT_CARTRIDGE:
+  printf("\n");
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void bus_timing(HANDLE fd)
+{
+  char *end;
+  char line[16];
+  unsigned char profile;
+  unsigned long choice;
+
+  if (verbose) printf("bus_timing\n");
+
+  if (rom_title[0] == 0) {
+    printf("Error no cartridge info\n");
+    goto L_END_BUS_TIMING;
+  }
+  if (!(cart_info.capabilities & CAP_BUS_TIMING)) {
+    printf("Firmware doesn't support timing profiles, update it\n");
+    goto L_END_BUS_TIMING;
+  }
+
+  if (calibrate_bus(fd) == 1) goto L_END_BUS_TIMING;
+
+  printf("Profile to use (0-%d, empty to keep): ", BUS_DELAY_MAX);
+  if (!fgets(line, sizeof(line), stdin) || (line[0] == '\n')) goto L_END_BUS_TIMING;
+  choice = strtoul(line, &end, 10);
+  if ((end == line) || (choice > BUS_DELAY_MAX)) {
+    printf("Invalid option\n");
+    goto L_END_BUS_TIMING;
+  }
+  profile = choice;
+
+  if (send_command(fd, SET_BUS_DELAY_COMMAND)) goto L_END_BUS_TIMING;
+
+  /* Need: PROFILE */
+  if (serial_write(fd, &profile, 1) != 1) {
+    printf("Error sending packet: %s\n", strerror(errno));
+    goto L_END_BUS_TIMING;
+  }
+  if (wait_ack(fd, SET_BUS_DELAY_COMMAND, link_timeout(1 + 3))) goto L_END_BUS_TIMING;
+  printf("Bus timing: profile %d (~%.0f ns)\n", profile, bus_delay_ns(profile));
+
+L_END_BUS_TIMING:
+  printf("\n");
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned char recv_exact(HANDLE fd, unsigned char *buf, ssize_t len)
+{
+  ssize_t ret;
+  unsigned long start;
+
+  start = get_time();
+  while (len > 0) {
+    ret = serial_read(fd, buf, len);
+    if (ret > 0) {
+      buf += ret;
+      len -= ret;
+      start = get_time();
+    }
+    else if (!time_valid(start)) {
+      return 1;
+    }
+    else {
+      serial_wait(fd, POLL_INTERVAL);
+    }
+  }
 
   return 0;
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static unsigned char recv_routine_file(HANDLE fd, ssize_t packet_size, FILE *fp, unsigned char print_state)
+static void watch_ram(HANDLE fd)
+{
+  int n;
+  FILE *mirror_fp;
+  FILE *log_fp;
+  char line[256];
+  char mirror_filename[32];
+  char log_filename[32];
+  unsigned char c;
+  unsigned char stop = WATCH_RAM_COMMAND;
+  unsigned char stopping = 0;
+  unsigned char size_bytes[4];
+  unsigned char frame[6 + WATCH_BLOCK_SIZE];
+  unsigned char *time_bytes = frame;
+  unsigned char *mirror = NULL;
+  unsigned long i;
+  unsigned long size;
+  unsigned long block;
+  unsigned long diffs;
+  unsigned long offset;
+  unsigned long passes = 0;
+  unsigned long changes = 0;
+  unsigned long received = 0;
+  unsigned long first_time = 0;
+  unsigned long frame_time;
+  unsigned long long start;
+
+  if (verbose) printf("watch_ram\n");
+
+  if (rom_title[0] == 0) {
+    printf("Error no cartridge info\n");
+    goto L_END_WATCH_RAM;
+  }
+  if (cart_info.ram_size == 0) {
+    printf("Cartridge has no RAM\n");
+    goto L_END_WATCH_RAM;
+  }
+  if (!(cart_info.capabilities & CAP_RAM_WATCH)) {
+    printf("Firmware doesn't support watching RAM, update it\n");
+    goto L_END_WATCH_RAM;
+  }
+
+  sprintf(mirror_filename, "%s.watch.sav", rom_title);
+  sprintf(log_filename, "%s.watch.log", rom_title);
+  mirror_fp = fopen(mirror_filename, "wb");
+  if (!mirror_fp) {
+    printf("Error creating %s: %s\n", mirror_filename, strerror(errno));
+    goto L_END_WATCH_RAM;
+  }
+  log_fp = fopen(log_filename, "a");
+  if (!log_fp) {
+    printf("Error creating %s: %s\n", log_filename, strerror(errno));
+    fclose(mirror_fp);
+    goto L_END_WATCH_RAM;
+  }
+  mirror = (unsigned char *)calloc(1, cart_info.ram_size); // assume success
+
+  if (send_command(fd, WATCH_RAM_COMMAND)) goto L_CLOSE_WATCH_RAM;
+
+  printf("Watching RAM, mirror in %s, changes logged to %s\n", mirror_filename, log_filename);
+  printf("Press CTRL+C to stop\n");
+  fprintf(log_fp, "# %s %lu bytes\n", rom_title, cart_info.ram_size);
+
+  /* Need: DLE + STX + SIZE(4) + frame, until DLE + ACK + WATCH_RAM_COMMAND once stopped */
+  start = get_time_us();
+  for (;;) {
+    if (ctrlc && !stopping) {
+      ctrlc = 0;
+      stopping = 1;
+      if (serial_write(fd, &stop, 1) != 1) {
+        printf("Error sending packet: %s\n", strerror(errno));
+        break;
+      }
+    }
+
+    if (recv_exact(fd, &c, 1)) goto L_TIMEOUT_WATCH_RAM;
+    if (c != 0x10) continue;
+    if (recv_exact(fd, &c, 1)) goto L_TIMEOUT_WATCH_RAM;
+    if (c == ACK) {
+      if (recv_exact(fd, &c, 1)) goto L_TIMEOUT_WATCH_RAM;
+      if (c == WATCH_RAM_COMMAND) break;
+      continue;
+    }
+    if (c != 0x02) continue;
+
+    if (recv_exact(fd, size_bytes, 4)) goto L_TIMEOUT_WATCH_RAM;
+    size = long_from_array(size_bytes);
+    if ((size != 6) && (size != sizeof(frame))) {
+      printf("Error bad watch frame\n");
+      break;
+    }
+    if (recv_exact(fd, frame, size)) goto L_TIMEOUT_WATCH_RAM;
+    received += 6 + size;
+
+    frame_time = long_from_array(time_bytes);
+    if (!passes && !first_time) first_time = frame_time;
+    block = (frame[4] << 8) | frame[5];
+
+    if (block == WATCH_END_OF_PASS) {
+      /* first pass is the whole RAM */
+      if (!passes) {
+        fwrite(mirror, 1, cart_info.ram_size, mirror_fp);
+        fflush(mirror_fp);
+      }
+      passes++;
+      continue;
+    }
+
+    offset = block * WATCH_BLOCK_SIZE;
+    if ((size != sizeof(frame)) || ((offset + WATCH_BLOCK_SIZE) > cart_info.ram_size)) {
+      printf("Error bad watch frame\n");
+      break;
+    }
+    if (!passes) {
+      memcpy(mirror + offset, frame + 6, WATCH_BLOCK_SIZE);
+      continue;
+    }
+
+    /* log which bytes changed */
+    n = sprintf(line, "%10.3f s 0x%05lX-0x%05lX", (frame_time - first_time) / 1000.0, offset, offset + WATCH_BLOCK_SIZE - 1);
+    diffs = 0;
+    for (i = 0; i < WATCH_BLOCK_SIZE; i++) {
+      if (mirror[offset + i] == frame[6 + i]) continue;
+      if (diffs < WATCH_LOG_DIFFS) n += sprintf(line + n, " %05lX:%02X>%02X", offset + i, mirror[offset + i], frame[6 + i]);
+      diffs++;
+    }
+    if (diffs > WATCH_LOG_DIFFS) n += sprintf(line + n, " (+%lu)", diffs - WATCH_LOG_DIFFS);
+    printf("%s\n", line);
+    fprintf(log_fp, "%s\n", line);
+    fflush(log_fp);
+    changes++;
+
+    memcpy(mirror + offset, frame + 6, WATCH_BLOCK_SIZE);
+    fseek(mirror_fp, offset, SEEK_SET);
+    fwrite(mirror + offset, 1, WATCH_BLOCK_SIZE, mirror_fp);
+    fflush(mirror_fp);
+  }
+
+  printf("Watched %lu passes in %.1f s, %lu changed blocks, %lu bytes received\n",
+         passes, (get_time_us() - start) / 1000000.0, changes, received);
+  goto L_CLOSE_WATCH_RAM;
+
+L_TIMEOUT_WATCH_RAM:
+  printf("TIMEOUT: watch stopped\n");
+
+L_CLOSE_WATCH_RAM:
+  free(mirror);
+  fclose(log_fp);
+  fclose(mirror_fp);
+
+L_END_WATCH_RAM:
+  printf("\n");
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static const char* test_ram_name(unsigned char test)
+{
+  switch (test) {
+    case 0x01:
+      return "data bus";
+    case 0x02:
+      return "address bus";
+    case 0x03:
+      return "march";
+    case 0x04:
+      return "restore";
+    default:
+      return "unknown";
+  }
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void test_ram(HANDLE fd)
+{
+  int err;
+  FILE *fp;
+  ssize_t size;
+  char backup_filename[32];
+  unsigned char mask;
+  unsigned char done = 0;
+  unsigned char frame[5 + (16 * 2)];
+  unsigned char *long_bytes = frame + 1; /* progress address or failures */
+  unsigned char *fail_address_bytes = frame + 2;
+  unsigned char *backup = NULL;
+  unsigned short crc;
+  unsigned long i;
+  unsigned long bank;
+  unsigned long banks;
+  unsigned long bank_size;
+  unsigned long ram_size;
+  unsigned long address;
+  unsigned long failures = 0;
+  unsigned long bad_banks = 0;
+  unsigned long long start;
+  dump_digest dg;
+
+  if (verbose) printf("test_ram\n");
+
+  memset(&dg, 0, sizeof(dg));
+
+  if (rom_title[0] == 0) {
+    printf("Error no cartridge info\n");
+    goto L_END_TEST_RAM;
+  }
+  ram_size = cart_info.ram_size;
+  if (ram_size == 0) {
+    printf("Cartridge has no RAM\n");
+    goto L_END_TEST_RAM;
+  }
+  if (!(cart_info.capabilities & CAP_RAM_TEST)) {
+    printf("Firmware doesn't support testing RAM, update it\n");
+    goto L_END_TEST_RAM;
+  }
+
+  bank_size = (ram_size < 0x2000) ? ram_size : 0x2000;
+  banks = ram_size / bank_size;
+  if (banks > 16) {
+    printf("RAM size not supported\n");
+    goto L_END_TEST_RAM;
+  }
+  /* MBC2 RAM is 4 bits, firmware ignores the upper nibble */
+  mask = ((header_byte(0x0147) == 0x05) || (header_byte(0x0147) == 0x06)) ? 0x0F : 0xFF;
+
+  printf("The test overwrites every RAM byte and restores it, a backup is made first\n");
+  printf("Test RAM[y/n]? ");
+  if (!read_yes_no()) {
+    printf("No action done!\n");
+    goto L_END_TEST_RAM;
+  }
+
+  /* backup, only used if the RAM isn't the same after the test */
+  sprintf(backup_filename, "%s.backup.sav", rom_title);
+  printf("Reading RAM and saving backup to %s\n", backup_filename);
+
+  if (send_command(fd, READ_RAM_COMMAND)) goto L_END_TEST_RAM;
+  size = recv_packet_header_size(fd);
+  if (size != (ssize_t)ram_size) {
+    printf("Error got no packet size!\n");
+    goto L_END_TEST_RAM;
+  }
+  backup = (unsigned char *)malloc(ram_size); // assume success
+  digest_init(&dg, ram_size, 0x2000, 0);
+  if (recv_routine_buffer(fd, ram_size, backup, ram_size, &dg, 1)) {
+    printf("\nError reading RAM, no test done\n");
+    goto L_END_TEST_RAM;
+  }
+  printf("\n");
+
+  fp = fopen(backup_filename, "w+b");
+  if (!fp) {
+    printf("Error creating %s: %s\n", backup_filename, strerror(errno));
+    goto L_END_TEST_RAM;
+  }
+  if (fwrite(backup, 1, ram_size, fp) != ram_size) {
+    printf("Error writing %s: %s\n", backup_filename, strerror(errno));
+    goto L_CLOSE_TEST_RAM;
+  }
+  fflush(fp);
+  digest_final(&dg);
+  if ((err = write_manifest(&dg, backup_filename))) printf("Error creating %s.manifest: %s\n", backup_filename, strerror(err));
+
+  /* a dead battery usually leaves the RAM blank */
+  for (i = 1; (i < ram_size) && ((backup[i] & mask) == (backup[0] & mask)); i++);
+  if ((i == ram_size) && (((backup[0] & mask) == 0x00) || ((backup[0] & mask) == mask))) {
+    printf("Warning: RAM is blank (all 0x%02X), battery may be dead or the save was erased\n", backup[0] & mask);
+  }
+
+  if (send_command(fd, TEST_RAM_COMMAND)) goto L_CLOSE_TEST_RAM;
+
+  /* Need: progress and failure frames, then the done frame */
+  start = get_time_us();
+  while (!done) {
+    size = recv_packet_header_size(fd);
+    if ((size < 1) || (size > (ssize_t)sizeof(frame))) {
+      printf("\nError bad test frame\n");
+      goto L_CLOSE_TEST_RAM;
+    }
+    if (recv_routine_buffer(fd, size, frame, sizeof(frame), NULL, 0)) {
+      printf("\nError receiving test frame\n");
+      goto L_CLOSE_TEST_RAM;
+    }
+
+    switch (frame[0]) {
+      case TEST_PROGRESS:
+        if (size != 5) break;
+        address = long_from_array(long_bytes);
+        printf("\rTesting bank %lu, %3lu%%", address / bank_size, (address * 100) / ram_size);
+        fflush(stdout);
+        break;
+      case TEST_FAIL:
+        if (size != 8) break;
+        address = long_from_array(fail_address_bytes);
+        printf("\rFAIL %-11s bank %lu address 0x%04lX: expected 0x%02X got 0x%02X\n",
+               test_ram_name(frame[1]), address / bank_size, 0xA000 + (address % bank_size), frame[6], frame[7]);
+        break;
+      case TEST_DONE:
+        if (size != (ssize_t)(5 + (banks * 2))) {
+          printf("\nError bad test frame\n");
+          goto L_CLOSE_TEST_RAM;
+        }
+        failures = long_from_array(long_bytes);
+        done = 1;
+        break;
+      default:
+        break;
+    }
+  }
+
+  printf("\rTested %lu bytes in %.1f s: ", ram_size, (get_time_us() - start) / 1000000.0);
+  if (failures == 0) printf("RAM OK!\n");
+  else if (failures > TEST_MAX_FAILURES) printf("%lu failures (first %d shown), RAM NOK!\n", failures, TEST_MAX_FAILURES);
+  else printf("%lu failures, RAM NOK!\n", failures);
+
+  /* check the save survived, compare CRC16 of every bank with the backup */
+  for (bank = 0; bank < banks; bank++) {
+    crc = 0;
+    for (i = 0; i < bank_size; i++) crc = crc16_update(crc, backup[(bank * bank_size) + i] & mask);
+    if (crc != ((frame[5 + (bank * 2)] << 8) | frame[6 + (bank * 2)])) {
+      printf("Bank %lu differs from backup\n", bank);
+      bad_banks++;
+    }
+  }
+  if (bad_banks == 0) {
+    printf("Save data preserved\n");
+    goto L_CLOSE_TEST_RAM;
+  }
+
+  printf("Restoring RAM from %s\n", backup_filename);
+  rewind(fp);
+  if (send_command(fd, WRITE_RAM_COMMAND)) goto L_CLOSE_TEST_RAM;
+  if (send_routine_file(fd, fp, ram_size, WRITE_RAM_COMMAND, 1)) goto L_CLOSE_TEST_RAM;
+  verify_ram(fd, fp, ram_size);
+
+L_CLOSE_TEST_RAM:
+  fclose(fp);
+
+L_END_TEST_RAM:
+  digest_free(&dg);
+  free(backup);
+  printf("\n");
+}
+
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void station_run(HANDLE fd)
 {
-  ssize_t ret;
-  ssize_t start;
-  unsigned char rx_chunk[RECV_CHUNK_SIZE];
-  const ssize_t _packet_size = packet_size;
+  unsigned char present = 0;
+  unsigned char poll_errors = 0;
+  unsigned char header[0x0150 - 0x0134];
+  unsigned long cartridges = 0;
+  unsigned long long start;
 
-  if (verbose) printf("recv_routine_file\n");
+  if (verbose) printf("station_run\n");
 
-  start = get_time();
-  do {
-    ret = read(fd, rx_chunk, RECV_CHUNK_SIZE);
-    if (ret > 0) {
-      if (fwrite(rx_chunk, 1, ret, fp) != ret) {
-        printf("Error writing to file: %s\n", strerror(errno));
-        return 4;
+  if (station_start()) printf("Dumps are processed inline\n");
+
+  printf("Station mode: SAVE then ROM of every cartridge inserted, %u workers\n", station.workers_count);
+  printf("Press CTRL+C to stop\n");
+
+  while (!ctrlc) {
+    station_print_reports();
+
+    /* Need: a valid header different from the last cartridge dumped */
+    memset(&cart_info, 0, sizeof(cart_info));
+    if (get_info(fd)) {
+      /* the link recovers or resets the Arduino on its own, give up when it keeps failing */
+      if (++poll_errors > STATION_POLL_ERRORS) {
+        printf("Error polling the Arduino, station stopped\n");
+        break;
       }
-      packet_size -= ret;
-      start = get_time();
+      printf("Error polling the Arduino, retrying\n");
+      continue;
     }
-    else if (ret == 0) {
-      wait_ms(5); /* let's wait */
+    poll_errors = 0;
+    if (!validate_header_checksum()) {
+      if (present) printf("Cartridge removed, insert the next one\n");
+      present = 0;
+      sleep_us(STATION_POLL * 1000UL);
+      continue;
     }
-    else {
-      printf("Nasty: %s\n", strerror(errno));
-      return 3;
+    if (present && !memcmp(header, &header_byte(0x0134), sizeof(header))) {
+      sleep_us(STATION_POLL * 1000UL);
+      continue;
     }
-    if (print_state) print_state_console(_packet_size, (_packet_size - packet_size));
-    
-  } while ((packet_size > 0) && !ctrlc && time_valid(start));
-  if (print_state) printf("\n");
-  
-  if (ctrlc) return 1;
-  if (packet_size > 0) {
-    printf("ERROR: missing data!!!\n");
-    return 2;
+    memcpy(header, &header_byte(0x0134), sizeof(header));
+    present = 1;
+    cartridges++;
+
+    printf("#==========================#\n");
+    start = get_time_us();
+    *rom_title = 0;
+    read_header(fd, 1);
+    if (rom_title[0] == 0) continue;
+
+    /* the save is small and can't be dumped again if the battery dies, it goes first */
+    if (cart_info.ram_size) read_ram(fd);
+    if (!ctrlc) read_rom(fd);
+
+    printf("Cartridge %lu done in %.1f s, %lu jobs queued\n", cartridges, (get_time_us() - start) / 1000000.0, station_pending());
   }
 
-  return 0;
+  if (station.active) station_stop();
+  printf("Station stopped after %lu cartridges\n", cartridges);
+
+  /* back to the menu */
+  ctrlc = 0;
+  printf("\n");
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static unsigned char send_routine_file(HANDLE fd, FILE *fp, ssize_t file_size, unsigned char print_state)
+static unsigned char flash_rom_file(HANDLE fd, const char *rom_filename, unsigned char type, unsigned long image_size)
 {
-  ssize_t current_size = 0;
-  unsigned char tx_chunk[SEND_CHUNK_SIZE];
+  FILE *fp;
+  ssize_t ret;
+  unsigned char result = 1;
+  unsigned char params[5];
+  unsigned char *size_bytes;
+  unsigned char block[FLASH_BLOCK_SIZE];
+  unsigned char *crc_read = NULL;
+  unsigned short *crc_file = NULL;
+  unsigned long i;
+  unsigned long start;
+  unsigned long banks = image_size / 0x4000;
+  unsigned long bad_banks;
 
-  if (verbose) printf("send_routine_file\n");
+  if (verbose) printf("flash_rom_file\n");
 
-  do {
-    if (fread(tx_chunk, 1, SEND_CHUNK_SIZE, fp) != SEND_CHUNK_SIZE) {
+  params[0] = type;
+  size_bytes = params + 1;
+  long_to_array(size_bytes, image_size);
+
+  fp = fopen(rom_filename, "rb");
+  if (!fp) {
+    printf("Error openning %s: %s\n", rom_filename, strerror(errno));
+    return 1;
+  }
+
+  crc_file = (unsigned short *)calloc(banks, sizeof(unsigned short)); // assume success
+  crc_read = (unsigned char *)malloc(banks * 2); // assume success
+
+  if (send_command(fd, FLASH_ROM_COMMAND)) goto L_CLOSE_FLASH_ROM_FILE;
+
+  /* Need: TYPE + SIZE(4) */
+  if (serial_write(fd, params, sizeof(params)) != sizeof(params)) {
+    printf("Error sending packet: %s\n", strerror(errno));
+    goto L_CLOSE_FLASH_ROM_FILE;
+  }
+  if ((ret = wait_ack(fd, FLASH_ROM_COMMAND, link_timeout(sizeof(params) + 3)))) {
+    /* the firmware identifies the chip by CFI before erasing anything */
+    if (ret == 3) printf("=> Flash chip not identified, of another command set or smaller than the ROM, nothing erased\n");
+    goto L_CLOSE_FLASH_ROM_FILE;
+  }
+
+  /* firmware acknowledges each block on reception and programs it while the next one arrives,
+   * the last acknowledge comes once everything is programmed */
+  for (i = 0; (i < image_size) && !ctrlc; i += FLASH_BLOCK_SIZE) {
+    unsigned int j;
+    if (fread(block, 1, FLASH_BLOCK_SIZE, fp) != FLASH_BLOCK_SIZE) {
       printf("Error reading from file: %s\n", strerror(errno));
-      break;
+      goto L_CLOSE_FLASH_ROM_FILE;
+    }
+    for (j = 0; j < FLASH_BLOCK_SIZE; j++) {
+      crc_file[i / 0x4000] = crc16_update(crc_file[i / 0x4000], block[j]);
     }
-    if (write(fd, tx_chunk, SEND_CHUNK_SIZE) != SEND_CHUNK_SIZE) {
+    if (serial_write(fd, block, FLASH_BLOCK_SIZE) != FLASH_BLOCK_SIZE) {
       printf("Error sending packet: %s\n", strerror(errno));
-      break;
+      goto L_CLOSE_FLASH_ROM_FILE;
     }
-    current_size += SEND_CHUNK_SIZE;
-    wait_ms(10); /* let's wait */
-    if (print_state) print_state_console(file_size, current_size);
-  } while (!ctrlc && (current_size < file_size));
-  if (print_state) printf("\n");
+    /* a sector erase and the programming of the previous block happen before this one,
+     * the firmware gives up on the chip after FLASH_TIMEOUT and NAKs */
+    if (wait_ack(fd, FLASH_ROM_COMMAND, FLASH_TIMEOUT + (SERIAL_TIMEOUT * 1000))) {
+      printf("\nFlashing failed at 0x%06lX\n", i);
+      goto L_CLOSE_FLASH_ROM_FILE;
+    }
+    print_state_console((long)image_size, (long)(i + FLASH_BLOCK_SIZE));
+  }
+  printf("\n");
+  if (ctrlc) goto L_CLOSE_FLASH_ROM_FILE;
 
-  if (ctrlc) return 1;
-  if (current_size < file_size) {
-    printf("ERROR: missing data!!!\n");
-    return 2;
+  printf("Verifying\n");
+  if (recv_packet_header_size(fd) != (ssize_t)(banks * 2)) {
+    printf("=> Error with verify, try again\n");
+    goto L_CLOSE_FLASH_ROM_FILE;
+  }
+  /* the firmware reads a whole bank back before each CRC, slower than the link */
+  i = 0;
+  start = get_time();
+  while ((i < (banks * 2)) && !ctrlc && time_valid(start)) {
+    ret = serial_read(fd, crc_read + i, (banks * 2) - i);
+    if (ret > 0) {
+      i += ret;
+      start = get_time();
+      print_state_console((long)(banks * 2), (long)i);
+    }
+    else {
+      serial_wait(fd, POLL_INTERVAL);
+    }
+  }
+  printf("\n");
+  if (i < (banks * 2)) {
+    printf("=> Error with verify, try again\n");
+    goto L_CLOSE_FLASH_ROM_FILE;
   }
 
-  return 0;
+  bad_banks = 0;
+  for (i = 0; i < banks; i++) {
+    unsigned short crc = (crc_read[i * 2] << 8) | crc_read[(i * 2) + 1];
+    if (crc != crc_file[i]) {
+      printf("Bank %lu: CRC %04X, expected %04X\n", i, crc, crc_file[i]);
+      bad_banks++;
+    }
+  }
+  if (bad_banks) {
+    printf("=> FLASH NOK(%lu banks differ)!\n", bad_banks);
+  }
+  else {
+    printf("=> FLASH OK!\n");
+    result = 0;
+  }
+
+L_CLOSE_FLASH_ROM_FILE:
+  free(crc_read);
+  free(crc_file);
+  fclose(fp);
+
+  return result;
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static void verify_ram(HANDLE fd, FILE *fp, unsigned long ram_size)
+static void flash_rom(HANDLE fd)
 {
+  char *nl;
   char option;
   char clear_option;
-  unsigned char *RAM_read;
-  unsigned char *RAM_file;
+  char rom_filename[256];
+  ssize_t file_size;
 
-  if (verbose) printf("verify_ram\n");
+  if (verbose) printf("flash_rom\n");
 
-  printf("Verify RAM?[y/n]? ");
+  printf("ROM file to flash: ");
+  if (!fgets(rom_filename, sizeof(rom_filename), stdin)) goto L_END_FLASH_ROM;
+  if ((nl = strchr(rom_filename, '\n'))) *nl = '\0';
+
+  if (get_file_size(rom_filename, &file_size)) {
+    printf("No file found or couldn't open file\n");
+    goto L_END_FLASH_ROM;
+  }
+  if ((file_size == 0) || (file_size > 0x800000) || (file_size % 0x4000)) {
+    printf("ROM file cannot be used!\n");
+    goto L_END_FLASH_ROM;
+  }
+
+  printf("Flash type: 0) AMD 1) AMD buffered 2) Intel 3) Intel buffered? ");
   option = getchar();
   do { clear_option = getchar(); } while (clear_option != '\n');
+  if ((option < '0') || (option > '3')) {
+    printf("Invalid option\n");
+    goto L_END_FLASH_ROM;
+  }
 
-  if (option != 'y') return;
-  printf("Reading RAM\n");
+  printf("Erase cartridge and flash %s[y/n]? ", rom_filename);
+  if (!read_yes_no()) {
+    printf("No action done!\n");
+    goto L_END_FLASH_ROM;
+  }
 
-  flush_serial(fd);
+  flash_rom_file(fd, rom_filename, option - '0', file_size);
 
-  if (send_packet_routine(fd, READ_RAM_COMMAND)) return;
+L_END_FLASH_ROM:
+  printf("\n");
+}
 
-  /* UGLY => TODO: compare chunks of data */
-  RAM_read = (unsigned char *)malloc(ram_size); // assume success
-  RAM_file = (unsigned char *)malloc(ram_size); // assume success
+#if !(defined(_WIN32) || defined(_WIN64))
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+#define BENCH_TIME_BUDGET     ( 30 ) /* seconds of emulated link time per configuration */
+#define BENCH_LATENCY_RUNS    ( 50 )
+#define BENCH_REGRESSION      ( 10 ) /* percent */
+#define BENCH_MAX_RESULTS     ( 256 )
+
+/* modelled chip and its wiring on the cartridge */
+#define EMU_CHIP_BYTE_MODE    0x01 /* x16 chip in byte mode: unlock at 0xAAA/0x555 */
+#define EMU_CHIP_SWAP_ADDRESS 0x02 /* A0/A1 swapped */
+#define EMU_CHIP_SWAP_DATA    0x04 /* D0/D1 swapped */
+#define EMU_CHIP_BOTTOM_BOOT  0x08 /* 8 x 8KB sectors at the bottom */
+#define EMU_CHIP_TOP_BOOT     0x10 /* 8 x 8KB sectors at the top, CFI regions listed bottom first */
+#define EMU_CHIP_NO_CFI       0x20
+#define EMU_CHIP_NO_BUFFER    0x40
+
+/* flash chip of the cartridge, driven by bus cycles like the real one */
+typedef struct {
+  unsigned char intel;            /* command set of the chip, AMD otherwise */
+  unsigned char chip;             /* EMU_CHIP_ flags */
+  unsigned char query;            /* reads return the CFI table */
+  unsigned char step;             /* position in a command sequence */
+  unsigned char status_mode;      /* Intel: reads return the status register */
+  unsigned char status;           /* Intel status register */
+  unsigned char toggle;           /* AMD DQ6 */
+  unsigned char failed;           /* AMD: DQ5 set, toggling until reset */
+  unsigned char fail_pending;
+  unsigned long long busy_until;
+  unsigned long buffer_address;
+  unsigned int buffer_count;
+  unsigned long erase_us;         /* per sector */
+  unsigned long program_us;       /* per byte or write buffer */
+  unsigned long bank_read_us;     /* firmware reading a bank back for the verify */
+  long fail_erase;                /* sector that does not erase, -1 for none */
+  long fail_program;              /* address that does not program, -1 for none */
+  unsigned char regions;          /* erase block regions, lowest address first */
+  unsigned long region_blocks[FLASH_MAX_REGIONS];
+  unsigned long region_size[FLASH_MAX_REGIONS];
+} emu_flash;
+
+/* firmware stand-in running on the master side of a pty */
+typedef struct {
+  HANDLE fd;
+  unsigned long baud;             /* 0: unlimited */
+  unsigned long long tx_free;     /* when the emulated link is free again */
+  unsigned long long rx_free;
+  unsigned char *rom;
+  unsigned long rom_size;
+  unsigned char *ram;
+  unsigned long ram_size;
+  emu_flash flash;                /* rom is the chip array */
+  unsigned short bank;            /* MBC5 ROM bank register */
+  unsigned char flash_blocks[2][FLASH_BLOCK_SIZE];
+  unsigned char *flash_recv_block;
+  unsigned int flash_recv_count;
+} emu_state;
+
+typedef struct {
+  unsigned long baud;
+  unsigned long chunk;
+  unsigned long size;
+  char op[24];
+  double bytes_per_s;
+  double cpu_ms;
+  double p50;
+  double p90;
+  double p99;
+} bench_result;
 
-  /* go back to begin of file */
-  rewind(fp);
-  fread(RAM_file, 1, ram_size, fp); // assume success
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static void emu_pace(emu_state *emu, unsigned long long *link_free, size_t n)
+{
+  unsigned long long now;
 
-  if (recv_packet_header_size(fd) == ram_size) {
-    if (recv_routine_buffer(fd, ram_size, RAM_read, ram_size, verbose) == 0) {
-      if (memcmp(RAM_read, RAM_file, ram_size) != 0) {
-        printf("=> RAM NOK(possibly corrupted)!\n");
-      }
-      else {
-        printf("=> RAM OK!\n");
-      }
+  if (!emu->baud) return;
+
+  /* 10 bits per byte on the wire */
+  now = get_time_us();
+  if (*link_free < now) *link_free = now;
+  *link_free += (n * 10ULL * 1000000ULL) / emu->baud;
+  if (*link_free > now) usleep(*link_free - now);
+}
+
+static void emu_send(emu_state *emu, const unsigned char *buf, size_t n)
+{
+  size_t len;
+  ssize_t ret;
+
+  while (n > 0) {
+    len = (n > 64) ? 64 : n;
+    emu_pace(emu, &emu->tx_free, len);
+    ret = write(emu->fd, buf, len);
+    if (ret <= 0) _exit(0);
+    buf += ret;
+    n -= ret;
+  }
+}
+
+static void emu_send_header(emu_state *emu, unsigned long size)
+{
+  unsigned char header[6];
+  unsigned char *size_bytes = header + 2;
+  header[0] = 0x10;
+  header[1] = 0x02;
+  long_to_array(size_bytes, size);
+  emu_send(emu, header, sizeof(header));
+}
+
+static void emu_send_ack(emu_state *emu, unsigned char type, unsigned char code)
+{
+  unsigned char ack[3];
+  ack[0] = 0x10;
+  ack[1] = type;
+  ack[2] = code;
+  emu_send(emu, ack, sizeof(ack));
+}
+
+static int emu_recv(emu_state *emu, unsigned char *c, unsigned int timeout_ms)
+{
+  ssize_t ret;
+
+  if (wait_readable(emu->fd, timeout_ms) <= 0) return -1;
+  ret = read(emu->fd, c, 1);
+  if (ret <= 0) _exit(0); /* host closed the pty */
+  emu_pace(emu, &emu->rx_free, 1);
+  return 0;
+}
+
+/* same frames as the firmware, mirrors found by plain compare */
+static void emu_send_rom_map(emu_state *emu)
+{
+  unsigned long i;
+  unsigned long bank;
+  unsigned long source;
+  unsigned long banks = emu->rom_size / 0x4000;
+  unsigned char frame[3];
+  const unsigned char *data;
+
+  frame[0] = (banks >> 8) & 0xFF;
+  frame[1] = banks & 0xFF;
+  emu_send_header(emu, 2);
+  emu_send(emu, frame, 2);
+
+  for (bank = 0; bank < banks; bank++) {
+    data = emu->rom + (bank * 0x4000);
+    for (i = 0; (i < 0x4000) && (data[i] == 0xFF); i++);
+    if (i == 0x4000) {
+      frame[0] = BANK_BLANK;
+      emu_send_header(emu, 1);
+      emu_send(emu, frame, 1);
+      continue;
     }
-    else {
-      printf("=> Error with RAM, try again\n");
+    for (source = 0; (source < bank) && memcmp(emu->rom + (source * 0x4000), data, 0x4000); source++);
+    if (source < bank) {
+      frame[0] = BANK_MIRROR;
+      frame[1] = (source >> 8) & 0xFF;
+      frame[2] = source & 0xFF;
+      emu_send_header(emu, 3);
+      emu_send(emu, frame, 3);
+      continue;
     }
+    frame[0] = BANK_DATA;
+    emu_send_header(emu, 1 + 0x4000);
+    emu_send(emu, frame, 1);
+    emu_send(emu, data, 0x4000);
+  }
+}
+
+static void emu_send_range(emu_state *emu)
+{
+  unsigned int i;
+  unsigned char params[7];
+  unsigned long bank;
+  unsigned long offset;
+  unsigned long length;
+  unsigned long bank_size;
+  unsigned long area_size;
+  const unsigned char *data;
+
+  /* Need: AREA + BANK(2) + OFFSET(2) + LENGTH(2) */
+  for (i = 0; i < sizeof(params); i++) {
+    if (emu_recv(emu, params + i, 100)) break;
+  }
+  bank = (params[1] << 8) | params[2];
+  offset = (params[3] << 8) | params[4];
+  length = (params[5] << 8) | params[6];
+  if (params[0] == AREA_RAM) {
+    data = emu->ram;
+    area_size = emu->ram_size;
+    bank_size = (area_size < 0x2000) ? area_size : 0x2000;
   }
   else {
-    printf("=> Error with RAM, try again\n");
+    data = emu->rom;
+    area_size = emu->rom_size;
+    bank_size = 0x4000;
   }
 
-  free(RAM_file);
-  free(RAM_read);
+  if ((i < sizeof(params)) || (params[0] > AREA_RAM) || (bank >= (area_size / bank_size)) || (length == 0) ||
+      (offset >= bank_size) || (length > (bank_size - offset))) {
+    emu_send_header(emu, 0);
+    return;
+  }
+  emu_send_header(emu, length);
+  emu_send(emu, data + (bank * bank_size) + offset, length);
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static unsigned char get_ram_size(HANDLE fd, ssize_t *out_ram_size)
+static void emu_flash_busy(emu_flash *f, unsigned long us, unsigned char fail)
 {
-  ssize_t size;
-  unsigned char ram_info[4];
-  
-  if (verbose) printf("get_ram_size\n");
+  f->busy_until = get_time_us() + us;
+  f->fail_pending = fail;
+  f->status_mode = 1;
+  f->status = 0x00;
+}
+
+static void emu_flash_layout(emu_state *emu)
+{
+  emu_flash *f = &emu->flash;
+  unsigned long big = (emu->rom_size / 0x10000) - 1;
+
+  /* 64KB sectors, boot block chips split one of them in 8KB sectors */
+  f->regions = 1;
+  f->region_blocks[0] = emu->rom_size / 0x10000;
+  f->region_size[0] = 0x10000;
+  if (f->chip & (EMU_CHIP_BOTTOM_BOOT | EMU_CHIP_TOP_BOOT)) {
+    unsigned char boot = (f->chip & EMU_CHIP_BOTTOM_BOOT) ? 0 : 1;
+    f->regions = 2;
+    f->region_blocks[boot] = 8;
+    f->region_size[boot] = 0x2000;
+    f->region_blocks[boot ^ 1] = big;
+    f->region_size[boot ^ 1] = 0x10000;
+  }
+}
 
-  flush_serial(fd);
+/* sector index of a chip address, start and size of the sector */
+static long emu_flash_sector(emu_flash *f, unsigned long address, unsigned long *start, unsigned long *size)
+{
+  unsigned int i;
+  long sector = 0;
+  unsigned long base = 0;
+
+  for (i = 0; i < f->regions; i++) {
+    unsigned long end = base + (f->region_blocks[i] * f->region_size[i]);
+    if (address < end) {
+      *size = f->region_size[i];
+      *start = address - ((address - base) % *size);
+      return sector + ((address - base) / *size);
+    }
+    sector += f->region_blocks[i];
+    base = end;
+  }
+  *start = *size = 0;
+  return -1;
+}
 
-  if (send_packet_routine(fd, GET_RAM_SIZE)) return 1;
+static unsigned char emu_flash_cfi(emu_state *emu, unsigned long offset)
+{
+  emu_flash *f = &emu->flash;
+  unsigned int r;
+  unsigned char log2 = 0;
+
+  if ((offset >= 0x10) && (offset <= 0x12)) return "QRY"[offset - 0x10];
+  if ((offset >= 0x40) && (offset <= 0x44)) return "PRI13"[offset - 0x40];
+  if ((offset >= 0x2D) && (offset < (0x2DUL + (4 * f->regions)))) {
+    /* top boot chips list their regions bottom first */
+    r = (offset - 0x2D) / 4;
+    if (f->chip & EMU_CHIP_TOP_BOOT) r = f->regions - 1 - r;
+    switch ((offset - 0x2D) % 4) {
+      case 0: return (f->region_blocks[r] - 1) & 0xFF;
+      case 1: return ((f->region_blocks[r] - 1) >> 8) & 0xFF;
+      case 2: return (f->region_size[r] / 256) & 0xFF;
+      default: return ((f->region_size[r] / 256) >> 8) & 0xFF;
+    }
+  }
+  switch (offset) {
+    case 0x13: return f->intel ? 0x01 : 0x02; /* command set */
+    case 0x15: return 0x40;                   /* primary extended table */
+    case 0x27:
+      while ((1UL << log2) < emu->rom_size) log2++;
+      return log2;
+    case 0x2A: return (f->chip & EMU_CHIP_NO_BUFFER) ? 0 : 5; /* 32 bytes write buffer */
+    case 0x2C: return f->regions;
+    case 0x4F: return (f->chip & EMU_CHIP_TOP_BOOT) ? 0x03 : 0x02;
+  }
+  return 0x00;
+}
 
-  wait_ms(10); /* give some time */
+static unsigned long emu_flash_wire(emu_flash *f, unsigned long value, unsigned char flag)
+{
+  /* the same swap both ways */
+  if (!(f->chip & flag)) return value;
+  return (value & ~0x03UL) | ((value & 0x01) << 1) | ((value >> 1) & 0x01);
+}
 
-  size = recv_packet_header_size(fd);
-  if (size > 0) {
-    if (recv_routine_buffer(fd, size, ram_info, sizeof(ram_info), 0)) return 2;
+static void emu_flash_write(emu_state *emu, unsigned long address, unsigned char data)
+{
+  long sector;
+  unsigned long start;
+  unsigned long size;
+  emu_flash *f = &emu->flash;
+  unsigned int unlock = address & 0x0FFF;
+  unsigned int unlock1 = (f->chip & EMU_CHIP_BYTE_MODE) ? 0x0AAA : 0x0555;
+  unsigned int unlock2 = (f->chip & EMU_CHIP_BYTE_MODE) ? 0x0555 : 0x02AA;
+
+  /* the chip ignores commands while an operation runs */
+  if (get_time_us() < f->busy_until) return;
+
+  /* CFI query from read mode, left with reset or read array */
+  if (f->query) {
+    if (data == (f->intel ? 0xFF : 0xF0)) f->query = 0;
+    return;
   }
-  else {
-    /* We must have size */
-    printf("Error got no packet size!\n");
-    return 3;
+  if ((data == 0x98) && !(f->chip & EMU_CHIP_NO_CFI) && (f->step == 0) && !f->failed &&
+      (f->intel ? !f->status_mode : (unlock == ((f->chip & EMU_CHIP_BYTE_MODE) ? 0x00AA : 0x0055)))) {
+    f->query = 1;
+    return;
+  }
+
+  if (f->intel) {
+    switch (f->step) {
+      case 1: /* erase confirm */
+        f->step = 0;
+        if (data != 0xD0) {
+          f->status = 0x80 | 0x30; /* command sequence error */
+          break;
+        }
+        sector = emu_flash_sector(f, address, &start, &size);
+        if (sector != f->fail_erase) memset(emu->rom + start, 0xFF, size);
+        emu_flash_busy(f, f->erase_us, (sector == f->fail_erase) ? 0x20 : 0);
+        break;
+      case 2: /* program */
+        f->step = 0;
+        if ((long)address != f->fail_program) emu->rom[address] &= data;
+        emu_flash_busy(f, f->program_us, ((long)address == f->fail_program) ? 0x10 : 0);
+        break;
+      case 3: /* buffer word count */
+        f->buffer_address = address;
+        f->buffer_count = data + 1;
+        f->fail_pending = 0;
+        f->step = 4;
+        break;
+      case 4: /* buffer data */
+        if ((long)address != f->fail_program) emu->rom[address] &= data;
+        else f->fail_pending = 0x10;
+        if (--f->buffer_count == 0) f->step = 5;
+        break;
+      case 5: /* buffer confirm */
+        f->step = 0;
+        emu_flash_busy(f, f->program_us, (data == 0xD0) ? f->fail_pending : 0x30);
+        break;
+      default:
+        if (data == 0x20) f->step = 1;
+        else if ((data == 0x40) || (data == 0x10)) f->step = 2;
+        else if (data == 0xE8) {
+          f->step = 3;
+          f->status_mode = 1;
+          f->status = 0x80; /* write buffer available */
+        }
+        else if (data == 0x50) f->status = 0x80;
+        else if (data == 0x70) f->status_mode = 1;
+        else if (data == 0xFF) f->status_mode = 0;
+        break;
+    }
+    return;
   }
 
-  *out_ram_size = long_from_array(ram_info);
-  if (verbose) printf("Got RAM size: %ld\n", *out_ram_size);
+  /* reset works from any state but data cycles, also after DQ5 */
+  if ((data == 0xF0) && (f->step != 3) && (f->step != 7) && (f->step != 8)) {
+    f->step = 0;
+    f->failed = 0;
+    return;
+  }
+  if (f->failed) return;
 
-  return 0;
+  switch (f->step) {
+    case 0:
+    case 4:
+      f->step = ((unlock == unlock1) && (data == 0xAA)) ? f->step + 1 : 0;
+      break;
+    case 1:
+    case 5:
+      f->step = ((unlock == unlock2) && (data == 0x55)) ? f->step + 1 : 0;
+      break;
+    case 2:
+      f->step = 0;
+      if ((unlock == unlock1) && (data == 0xA0)) f->step = 3;
+      else if ((unlock == unlock1) && (data == 0x80)) f->step = 4;
+      else if (data == 0x25) {
+        f->buffer_address = address;
+        f->step = 7;
+      }
+      break;
+    case 3: /* program */
+      f->step = 0;
+      if ((long)address != f->fail_program) emu->rom[address] &= data;
+      emu_flash_busy(f, f->program_us, (long)address == f->fail_program);
+      break;
+    case 6: /* sector erase */
+      f->step = 0;
+      if (data != 0x30) break;
+      sector = emu_flash_sector(f, address, &start, &size);
+      if (sector != f->fail_erase) memset(emu->rom + start, 0xFF, size);
+      emu_flash_busy(f, f->erase_us, sector == f->fail_erase);
+      break;
+    case 7: /* buffer word count */
+      f->buffer_count = data + 1;
+      f->fail_pending = 0;
+      f->step = 8;
+      break;
+    case 8: /* buffer data */
+      if ((long)address != f->fail_program) emu->rom[address] &= data;
+      else f->fail_pending = 1;
+      if (--f->buffer_count == 0) f->step = 9;
+      break;
+    case 9: /* buffer confirm */
+      f->step = 0;
+      emu_flash_busy(f, f->program_us, (data == 0x29) ? f->fail_pending : 1);
+      break;
+    default:
+      f->step = 0;
+      break;
+  }
+}
+
+static unsigned char emu_flash_read(emu_state *emu, unsigned long address)
+{
+  emu_flash *f = &emu->flash;
+  unsigned char busy = (get_time_us() < f->busy_until);
+
+  if (f->query) return emu_flash_cfi(emu, (f->chip & EMU_CHIP_BYTE_MODE) ? (address >> 1) : address);
+
+  if (f->intel) {
+    if (!f->status_mode) return emu->rom[address];
+    if (busy) return 0x00;
+    if (f->fail_pending) {
+      f->status = 0x80 | f->fail_pending;
+      f->fail_pending = 0;
+    }
+    if (!f->status) f->status = 0x80;
+    return f->status;
+  }
+
+  /* DQ6 toggles while busy, keeps toggling with DQ5 once the chip gave up */
+  if (!busy && f->fail_pending) {
+    f->failed = 1;
+    f->fail_pending = 0;
+  }
+  if (busy || f->failed) {
+    f->toggle ^= 0x40;
+    return f->toggle | (f->failed ? 0x20 : 0x00);
+  }
+  return emu->rom[address];
+}
+
+/* same MBC5 mapping the firmware selects for flashing */
+static unsigned long emu_bus_address(emu_state *emu, unsigned int address)
+{
+  if (address < 0x4000) return address % emu->rom_size;
+  return (((unsigned long)emu->bank * 0x4000) + (address & 0x3FFF)) % emu->rom_size;
+}
+
+/* the MBC sees the bus as is, the flash chip through the cartridge wiring */
+static void emu_bus_write(emu_state *emu, unsigned int address, unsigned char data)
+{
+  emu_flash *f = &emu->flash;
+  if ((address >= 0x2000) && (address < 0x3000)) emu->bank = (emu->bank & 0x100) | data;
+  else if ((address >= 0x3000) && (address < 0x4000)) emu->bank = (emu->bank & 0xFF) | ((data & 0x01) << 8);
+  else emu_flash_write(emu, emu_flash_wire(f, emu_bus_address(emu, address), EMU_CHIP_SWAP_ADDRESS), emu_flash_wire(f, data, EMU_CHIP_SWAP_DATA));
+}
+
+static unsigned char emu_bus_read(emu_state *emu, unsigned int address)
+{
+  emu_flash *f = &emu->flash;
+  return emu_flash_wire(f, emu_flash_read(emu, emu_flash_wire(f, emu_bus_address(emu, address), EMU_CHIP_SWAP_ADDRESS)), EMU_CHIP_SWAP_DATA);
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static void read_header(HANDLE fd, unsigned char to_print)
+/* RecvFlashROM of the firmware, serial side, on top of the chip model */
+static void emu_flash_drain(emu_state *emu)
 {
-  ssize_t size;
-  unsigned char ChecksumOK;
-  char info[32];
+  ssize_t ret;
 
-  if (verbose) printf("read_header\n");
+  /* keep receiving the next block while the chip is busy */
+  if ((emu->flash_recv_count >= FLASH_BLOCK_SIZE) || (wait_readable(emu->fd, 0) <= 0)) return;
+  ret = read(emu->fd, emu->flash_recv_block + emu->flash_recv_count, FLASH_BLOCK_SIZE - emu->flash_recv_count);
+  if (ret <= 0) _exit(0); /* host closed the pty */
+  emu_pace(emu, &emu->rx_free, ret);
+  emu->flash_recv_count += ret;
+}
 
-  flush_serial(fd);
+/* the firmware flash code runs on the chip model, one emulator per process */
+static emu_state *flash_emu;
 
-  if (send_packet_routine(fd, READ_HEADER_COMMAND)) goto L_END_READ_HEADER;
+#define FLASH_WRITE(A, D)     emu_bus_write(flash_emu, A, D)
+#define FLASH_READ(A)         emu_bus_read(flash_emu, A)
+#define FLASH_MILLIS()        ( (unsigned long)(get_time_us() / 1000) )
+#define FLASH_BUSY_POLL()     emu_flash_drain(flash_emu)
+#define FLASH_CRC16(C, D)     crc16_update(C, D)
+#include "arduino-cartridge-rw/flash-rom.h"
 
-  wait_ms(10); /* give some time */
+static void emu_flash_rom(emu_state *emu)
+{
+  unsigned int i;
+  unsigned char type;
+  unsigned char error;
+  unsigned char current;
+  unsigned char params[5];
+  unsigned char crc_bytes[2];
+  unsigned char *size_bytes;
+  unsigned long address;
+  unsigned long image_size;
+  unsigned short bank;
+  unsigned short crc;
+
+  /* Need: TYPE + SIZE(4) */
+  for (i = 0; i < sizeof(params); i++) {
+    if (emu_recv(emu, params + i, 100)) {
+      emu_send_ack(emu, NAK, FLASH_ERR_PARAMS);
+      return;
+    }
+  }
+  type = params[0];
+  size_bytes = params + 1;
+  image_size = long_from_array(size_bytes);
+  if (FlashCheckParams(type, image_size)) {
+    emu_send_ack(emu, NAK, FLASH_ERR_PARAMS);
+    return;
+  }
+  flash_emu = emu;
+  if (FlashIdentify(type, image_size)) {
+    emu_send_ack(emu, NAK, FLASH_ERR_CHIP);
+    return;
+  }
+  emu_send_ack(emu, ACK, FLASH_ROM_COMMAND);
+
+  error = 0;
+  current = 0;
+  emu->flash_recv_block = emu->flash_blocks[current];
+  emu->flash_recv_count = 0;
+  for (address = 0; address < image_size; address += FLASH_BLOCK_SIZE) {
+    while ((emu->flash_recv_count < FLASH_BLOCK_SIZE) && (wait_readable(emu->fd, 100) > 0)) {
+      emu_flash_drain(emu);
+    }
+    if (emu->flash_recv_count < FLASH_BLOCK_SIZE) {
+      error = FLASH_ERR_RECV;
+      break;
+    }
+    if ((address + FLASH_BLOCK_SIZE) < image_size) emu_send_ack(emu, ACK, FLASH_ROM_COMMAND);
+    emu->flash_recv_block = emu->flash_blocks[current ^ 1];
+    emu->flash_recv_count = 0;
 
-  size = recv_packet_header_size(fd);
-  if (size <= 0) {
-    /* We must have size */
-    printf("Error got no packet size!\n");
-    goto L_END_READ_HEADER;
+    error = FlashWriteBlock(type, address, emu->flash_blocks[current]);
+    if (error) break;
+    current ^= 1;
   }
 
-  if (recv_routine_buffer(fd, size, (unsigned char *)info, sizeof(info), to_print)) goto L_END_READ_HEADER;
+  FlashReadArray(type);
 
-  ChecksumOK = info[info[0] + 1 + 5];
-  if (ChecksumOK) {
-    if (to_print) {
-      printf("Rom title: %s\n", info + 1);
-      printf("Cartridge type: %s\n", print_cartridge_string(info[info[0] + 1 + 1]));
-      printf("Rom size: %s\n", print_rom_size(info[info[0] + 1 + 2]));
-      printf("Ram size: %s\n", print_ram_size(info[info[0] + 1 + 3]));
-      printf("Rom version: %d\n", info[info[0] + 1 + 4]);
-      printf("Checksum: %d\n", info[info[0] + 1 + 5]);
+  if (error) {
+    unsigned char c;
+    emu_send_ack(emu, NAK, error);
+    while (emu_recv(emu, &c, 100) == 0);
+    return;
+  }
+  emu_send_ack(emu, ACK, FLASH_ROM_COMMAND);
+
+  /* verify: CRC16 of every bank read back */
+  emu_send_header(emu, (image_size / 0x4000) * 2);
+  for (bank = 0; bank < (image_size / 0x4000); bank++) {
+    crc = FlashBankCRC(bank);
+    if (emu->flash.bank_read_us) usleep(emu->flash.bank_read_us);
+    crc_bytes[0] = (crc >> 8) & 0xFF;
+    crc_bytes[1] = crc & 0xFF;
+    emu_send(emu, crc_bytes, 2);
+  }
+}
+
+static void emu_run(emu_state *emu)
+{
+  unsigned int i;
+  unsigned char c;
+  unsigned char packet[6];
+  unsigned char info[INFO_PACKET_SIZE];
+  unsigned char *size_bytes;
+  const unsigned char banner[] = { 0x10, 0x02, 0x00, 0x00, 0x00, 0x04, 'G', 'B', 'x', PROTOCOL_VERSION };
+
+  emu_send(emu, banner, sizeof(banner));
+
+  for (;;) {
+    /* Need: DLE + STX + SIZE(4) + CMD */
+    if (emu_recv(emu, &c, 1000) || (c != 0x10)) continue;
+    for (i = 0; i < sizeof(packet); i++) {
+      if (emu_recv(emu, packet + i, 100)) break;
+    }
+    size_bytes = packet + 1;
+    if ((i < sizeof(packet)) || (packet[0] != 0x02) || (long_from_array(size_bytes) != 1)) {
+      emu_send_header(emu, 0);
+      continue;
+    }
+
+    switch (packet[5]) {
+      case INFO_COMMAND:
+        emu_send_ack(emu, ACK, packet[5]);
+        memcpy(info, emu->rom + INFO_HEADER_START, INFO_HEADER_SIZE);
+        size_bytes = info + INFO_HEADER_SIZE;
+        long_to_array(size_bytes, emu->rom_size);
+        size_bytes += 4;
+        long_to_array(size_bytes, emu->ram_size);
+        info[INFO_HEADER_SIZE + 8] = PROTOCOL_VERSION;
+        info[INFO_HEADER_SIZE + 9] = ((CAP_RANGE_READ | CAP_BANK_MAP) >> 8) & 0xFF;
+        info[INFO_HEADER_SIZE + 10] = (CAP_RANGE_READ | CAP_BANK_MAP) & 0xFF;
+        emu_send_header(emu, sizeof(info));
+        emu_send(emu, info, sizeof(info));
+        break;
+      case READ_ROM_COMMAND:
+        emu_send_ack(emu, ACK, packet[5]);
+        emu_send_header(emu, emu->rom_size);
+        emu_send(emu, emu->rom, emu->rom_size);
+        break;
+      case READ_ROM_MAP_COMMAND:
+        emu_send_ack(emu, ACK, packet[5]);
+        emu_send_rom_map(emu);
+        break;
+      case READ_RANGE_COMMAND:
+        emu_send_ack(emu, ACK, packet[5]);
+        emu_send_range(emu);
+        break;
+      case READ_RAM_COMMAND:
+        emu_send_ack(emu, ACK, packet[5]);
+        emu_send_header(emu, emu->ram_size);
+        emu_send(emu, emu->ram, emu->ram_size);
+        break;
+      case WRITE_RAM_COMMAND:
+        emu_send_ack(emu, ACK, packet[5]);
+        for (i = 0; i < emu->ram_size; i++) {
+          if (emu_recv(emu, emu->ram + i, 1000)) break;
+          if (((i + 1) % SEND_CHUNK_SIZE) == 0) emu_send_ack(emu, ACK, WRITE_RAM_COMMAND);
+        }
+        break;
+      case FLASH_ROM_COMMAND:
+        emu_send_ack(emu, ACK, packet[5]);
+        emu_flash_rom(emu);
+        break;
+      default:
+        emu_send_ack(emu, NAK, packet[5]);
+        break;
     }
-    memcpy(rom_title, info + 1, info[0] + 1);
-  }
-  else {
-    printf("No cartridge inserted or cartridge read failed!\n");
   }
-
-L_END_READ_HEADER:
-  if (to_print) printf("\n");
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static void read_rom(HANDLE fd)
+static void bench_make_cart(emu_state *emu, unsigned long rom_size)
 {
-  int i;
-  FILE *fp;
-  ssize_t size;
-  char rom_filename[32];
-
-  if (verbose) printf("read_rom\n");
-
-  if (rom_title[0] == 0) {
-    printf("Error no cartridge info\n");
-    goto L_END_READ_ROM;
+  unsigned long i;
+  unsigned long x = 0x12345678UL;
+  unsigned char rom_code = 0;
+  unsigned char checksum = 0;
+  unsigned short global_checksum = 0;
+
+  while ((0x8000UL << rom_code) < rom_size) rom_code++;
+
+  emu->rom_size = rom_size;
+  emu->ram_size = (rom_size <= 0x8000) ? 0x2000 : ((rom_size <= 0x40000) ? 0x8000 : 0x20000);
+  emu->rom = (unsigned char *)malloc(emu->rom_size); // assume success
+  emu->ram = (unsigned char *)malloc(emu->ram_size); // assume success
+
+  /* xorshift filler */
+  for (i = 0; i < emu->rom_size; i++) {
+    x ^= (x << 13) & 0xFFFFFFFFUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xFFFFFFFFUL;
+    emu->rom[i] = x & 0xFF;
   }
-
-  i = strlen(rom_title);
-  memcpy(rom_filename, rom_title, i + 1);
-  rom_filename[i++] = '.';
-  rom_filename[i++] = 'g';
-  rom_filename[i++] = 'b';
-  rom_filename[i++] = '\0';
-
-  printf("Reading ROM and saving to %s\n", rom_filename);
-
-  fp = fopen(rom_filename, "wb");
-  if (!fp) {
-    printf("Error creating %s: %s\n", rom_filename, strerror(errno));
-    goto L_END_READ_ROM;
+  memcpy(emu->ram, emu->rom, emu->ram_size);
+
+  memset(emu->rom + 0x0134, 0, 0x0143 - 0x0134);
+  memcpy(emu->rom + 0x0134, "GBXBENCH", 8);
+  emu->rom[0x0147] = 0x1B; /* MBC5+RAM+BATTERY */
+  emu->rom[0x0148] = rom_code;
+  emu->rom[0x0149] = (emu->ram_size == 0x2000) ? 0x02 : ((emu->ram_size == 0x8000) ? 0x03 : 0x04);
+  emu->rom[0x014C] = 0;
+  for (i = 0x0134; i < 0x014D; i++) checksum = checksum - emu->rom[i] - 1;
+  emu->rom[0x014D] = checksum;
+  for (i = 0; i < emu->rom_size; i++) {
+    if ((i != 0x014E) && (i != 0x014F)) global_checksum += emu->rom[i];
   }
+  emu->rom[0x014E] = global_checksum >> 8;
+  emu->rom[0x014F] = global_checksum & 0xFF;
+}
 
-  flush_serial(fd);
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static pid_t bench_start_emulator(emu_state *emu, HANDLE *out_fd)
+{
+  int master;
+  HANDLE fd;
+  pid_t pid;
+  struct termios port_attr;
 
-  if (send_packet_routine(fd, READ_ROM_COMMAND)) {
-    fclose(fp);
-    goto L_END_READ_ROM;
+  master = posix_openpt(O_RDWR | O_NOCTTY);
+  if ((master == -1) || grantpt(master) || unlockpt(master)) {
+    printf("Error creating pty: %s\n", strerror(errno));
+    return -1;
+  }
+  fd = open(ptsname(master), O_RDWR | O_NOCTTY);
+  if (fd == -1) {
+    printf("Error opening pty: %s\n", strerror(errno));
+    close(master);
+    return -1;
   }
 
-  wait_ms(10); /* give some time */
+  /* raw before the stand-in writes its banner */
+  tcgetattr(fd, &port_attr);
+  cfmakeraw(&port_attr);
+  port_attr.c_cc[VMIN] = 0;
+  port_attr.c_cc[VTIME] = 0;
+  tcsetattr(fd, TCSANOW, &port_attr);
 
-  size = recv_packet_header_size(fd);
-  if (size > 0) {
-    recv_routine_file(fd, size, fp, 1);
+  pid = fork();
+  if (pid == 0) {
+    close(fd);
+    emu->fd = master;
+    emu_run(emu);
+    _exit(0);
   }
-  else {
-    /* We must have size */
-    printf("Error got no packet size!\n");
+  close(master);
+  if (pid == -1) {
+    printf("Error starting emulator: %s\n", strerror(errno));
+    close(fd);
+    return -1;
   }
 
-  fclose(fp);
+  *out_fd = fd;
+  return pid;
+}
 
-L_END_READ_ROM:
-  printf("\n");
+static void bench_stop_emulator(pid_t pid, HANDLE fd)
+{
+  close(fd);
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static void read_ram(HANDLE fd)
+static int bench_silence(int saved_stdout)
 {
-  int i;
-  FILE *fp;
-  ssize_t size;
-  char ram_filename[32];
+  int null_fd;
 
-  if (verbose) printf("read_ram\n");
-
-  if (rom_title[0] == 0) {
-    printf("Error no cartridge info\n");
-    goto L_END_READ_RAM;
+  fflush(stdout);
+  if (saved_stdout >= 0) {
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    return -1;
   }
+  saved_stdout = dup(STDOUT_FILENO);
+  null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  close(null_fd);
+  return saved_stdout;
+}
 
-  i = strlen(rom_title);
-  memcpy(ram_filename, rom_title, i + 1);
-  ram_filename[i++] = '.';
-  ram_filename[i++] = 's';
-  ram_filename[i++] = 'a';
-  ram_filename[i++] = 'v';
-  ram_filename[i++] = '\0';
+static double bench_cpu_ms()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return ((usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0) + ((usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0);
+}
 
-  printf("Reading RAM and saving to %s\n", ram_filename);
+static int bench_compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
 
-  fp = fopen(ram_filename, "wb");
-  if (!fp) {
-    printf("Error creating %s: %s\n", ram_filename, strerror(errno));
-    goto L_END_READ_RAM;
-  }
+/* the dump must hold what the emulated cartridge holds */
+static unsigned char bench_file_ok(const char *path, const unsigned char *data, unsigned long size)
+{
+  FILE *fp;
+  unsigned char ok;
+  unsigned char *file_data;
+  ssize_t file_size;
 
-  flush_serial(fd);
+  if (get_file_size(path, &file_size) || (file_size != (ssize_t)size) || !(fp = fopen(path, "rb"))) return 0;
+  file_data = (unsigned char *)malloc(size); // assume success
+  ok = (fread(file_data, 1, size, fp) == size) && (memcmp(file_data, data, size) == 0);
+  fclose(fp);
+  free(file_data);
+  return ok;
+}
 
-  if (send_packet_routine(fd, READ_RAM_COMMAND)) {
-    fclose(fp);
-    goto L_END_READ_RAM;
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static unsigned int bench_run_config(unsigned long baud, unsigned long chunk, unsigned long size, bench_result *results)
+{
+  int i;
+  int saved;
+  pid_t pid;
+  HANDLE fd;
+  emu_state emu;
+  unsigned char ok;
+  unsigned int n = 0;
+  double cpu;
+  double latencies[BENCH_LATENCY_RUNS];
+  unsigned long long start;
+  unsigned long long elapsed;
+
+  memset(&emu, 0, sizeof(emu));
+  emu.baud = baud;
+  bench_make_cart(&emu, size);
+  recv_chunk_size = chunk;
+
+  pid = bench_start_emulator(&emu, &fd);
+  if (pid == -1) goto L_END_BENCH_CONFIG;
+
+  saved = bench_silence(-1);
+
+  ok = (wait_boot_banner(fd) == 0);
+
+  /* read_header: latency of a small command */
+  strcpy(results[n].op, "read_header");
+  cpu = bench_cpu_ms();
+  start = get_time_us();
+  for (i = 0; ok && (i < BENCH_LATENCY_RUNS); i++) {
+    unsigned long long t = get_time_us();
+    *rom_title = 0;
+    read_header(fd, 0);
+    latencies[i] = (get_time_us() - t) / 1000.0;
+    ok = (*rom_title != 0);
+  }
+  elapsed = get_time_us() - start;
+  if (ok) {
+    qsort(latencies, BENCH_LATENCY_RUNS, sizeof(double), bench_compare_double);
+    results[n].bytes_per_s = (INFO_PACKET_SIZE * (double)BENCH_LATENCY_RUNS * 1000000.0) / elapsed;
+    results[n].cpu_ms = bench_cpu_ms() - cpu;
+    results[n].p50 = latencies[(BENCH_LATENCY_RUNS * 50) / 100];
+    results[n].p90 = latencies[(BENCH_LATENCY_RUNS * 90) / 100];
+    results[n].p99 = latencies[(BENCH_LATENCY_RUNS * 99) / 100];
+    n++;
   }
 
-  wait_ms(10); /* give some time */
-
-  size = recv_packet_header_size(fd);
-  if (size > 0) {
-    recv_routine_file(fd, size, fp, 1);
+  /* bulk transfers */
+  for (i = 0; ok && (i < 3); i++) {
+    unsigned long bytes;
+    cpu = bench_cpu_ms();
+    start = get_time_us();
+    switch (i) {
+      case 0:
+        read_rom(fd);
+        bytes = emu.rom_size;
+        ok = bench_file_ok("GBXBENCH.gb", emu.rom, bytes);
+        strcpy(results[n].op, "read_rom");
+        break;
+      case 1:
+        read_ram(fd);
+        bytes = emu.ram_size;
+        ok = bench_file_ok("GBXBENCH.sav", emu.ram, bytes);
+        strcpy(results[n].op, "read_ram");
+        break;
+      default:
+        /* write + verify read back, the emulator RAM must still match the save */
+        ok = (write_ram(fd) == 0);
+        bytes = emu.ram_size * 2;
+        strcpy(results[n].op, "write_ram");
+        break;
+    }
+    elapsed = get_time_us() - start;
+    if (!ok) break;
+    results[n].bytes_per_s = (bytes * 1000000.0) / elapsed;
+    results[n].cpu_ms = bench_cpu_ms() - cpu;
+    results[n].p50 = results[n].p90 = results[n].p99 = -1;
+    n++;
   }
-  else {
-    /* We must have size */
-    printf("Error got no packet size!\n");
+
+  bench_silence(saved);
+  bench_stop_emulator(pid, fd);
+
+  /* the failed operation and the ones after it are not reported nor saved to the baseline */
+  if (!ok) printf("%-8lu %-6lu %-8lu %-12s FAILED\n", baud, chunk, size, results[n].op);
+
+  for (i = 0; i < (int)n; i++) {
+    results[i].baud = baud;
+    results[i].chunk = chunk;
+    results[i].size = size;
   }
 
-  fclose(fp);
+  remove("GBXBENCH.gb");
+  remove("GBXBENCH.gb.manifest");
+  remove("GBXBENCH.sav");
+  remove("GBXBENCH.sav.manifest");
 
-L_END_READ_RAM:
-  printf("\n");
+L_END_BENCH_CONFIG:
+  free(emu.rom);
+  free(emu.ram);
+  recv_chunk_size = RECV_CHUNK_SIZE;
+  return n;
 }
 
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
-static void write_ram(HANDLE fd)
+/* flash_rom_file against the chip model, including a chip that gives up */
+static unsigned int bench_flash_cases()
 {
+  int saved;
+  pid_t pid;
+  HANDLE fd;
   FILE *fp;
-  ssize_t ram_size;
-  char ram_filename[32];
+  emu_state emu;
+  emu_state image;
+  unsigned long i;
+  unsigned int c;
+  unsigned int failed = 0;
+  unsigned char flashed;
+  unsigned char alive;
+  unsigned long long start;
+  static const struct {
+    const char *name;
+    unsigned char intel;
+    unsigned char type;
+    unsigned long size;
+    unsigned long erase_ms;
+    long fail_erase;
+    long fail_program;
+    unsigned char chip;
+    unsigned char expect_ok;
+  } cases[] = {
+    { "amd",                0, FLASH_AMD,            0x20000, 200,  -1, -1,      0,                                                               1 },
+    { "amd_buffered",       0, FLASH_AMD_BUFFERED,   0x20000, 200,  -1, -1,      0,                                                               1 },
+    { "intel",              1, FLASH_INTEL,          0x20000, 200,  -1, -1,      0,                                                               1 },
+    { "intel_buffered",     1, FLASH_INTEL_BUFFERED, 0x20000, 200,  -1, -1,      0,                                                               1 },
+    /* longer than a SERIAL_TIMEOUT wait for one block */
+    { "amd_slow_erase",     0, FLASH_AMD_BUFFERED,   0x10000, 4000, -1, -1,      0,                                                               1 },
+    { "amd_erase_fail",     0, FLASH_AMD,            0x20000, 200,  1,  -1,      0,                                                               0 },
+    { "amd_program_fail",   0, FLASH_AMD_BUFFERED,   0x20000, 200,  -1, 0x10010, 0,                                                               0 },
+    { "intel_erase_fail",   1, FLASH_INTEL_BUFFERED, 0x20000, 200,  0,  -1,      0,                                                               0 },
+    { "intel_program_fail", 1, FLASH_INTEL,          0x20000, 200,  -1, 0x4123,  0,                                                               0 },
+    /* sector map and wiring from the CFI query */
+    { "amd_bottom_boot",    0, FLASH_AMD_BUFFERED,   0x20000, 200,  -1, -1,      EMU_CHIP_BOTTOM_BOOT,                                            1 },
+    { "amd_top_boot",       0, FLASH_AMD_BUFFERED,   0x40000, 200,  -1, -1,      EMU_CHIP_TOP_BOOT,                                               1 },
+    { "amd_x16_swapped",    0, FLASH_AMD,            0x20000, 200,  -1, -1,      EMU_CHIP_BYTE_MODE | EMU_CHIP_SWAP_ADDRESS | EMU_CHIP_SWAP_DATA, 1 },
+    { "intel_swapped",      1, FLASH_INTEL_BUFFERED, 0x20000, 200,  -1, -1,      EMU_CHIP_SWAP_ADDRESS | EMU_CHIP_SWAP_DATA,                      1 },
+    { "no_cfi",             0, FLASH_AMD,            0x20000, 200,  -1, -1,      EMU_CHIP_NO_CFI,                                                 0 },
+    { "amd_as_intel",       0, FLASH_INTEL,          0x20000, 200,  -1, -1,      0,                                                               0 },
+    { "amd_no_buffer",      0, FLASH_AMD_BUFFERED,   0x20000, 200,  -1, -1,      EMU_CHIP_NO_BUFFER,                                              0 },
+    { "larger_than_chip",   0, FLASH_AMD,            0x80000, 200,  -1, -1,      0,                                                               0 },
+  };
 
-  if (verbose) printf("write_ram\n");
+  printf("\n%-20s %-8s %10s %s\n", "flash", "size", "seconds", "result");
+  for (c = 0; (c < sizeof(cases) / sizeof(cases[0])) && !ctrlc; c++) {
+    memset(&image, 0, sizeof(image));
+    bench_make_cart(&image, cases[c].size);
+    fp = fopen("GBXFLASH.gb", "wb");
+    if (!fp || (fwrite(image.rom, 1, image.rom_size, fp) != image.rom_size)) {
+      printf("Error creating GBXFLASH.gb: %s\n", strerror(errno));
+      if (fp) fclose(fp);
+      free(image.rom);
+      free(image.ram);
+      return failed + 1;
+    }
+    fclose(fp);
 
-  if (rom_title[0] == 0) {
-    printf("Error no cartridge info\n");
-    goto L_END_WRITE_RAM;
-  }
+    /* the chip holds an older game, programming only clears bits so nothing works without erase */
+    memset(&emu, 0, sizeof(emu));
+    emu.baud = 2000000;
+    bench_make_cart(&emu, 0x40000);
+    for (i = 0; i < emu.rom_size; i++) emu.rom[i] ^= 0x5A;
+    emu.flash.intel = cases[c].intel;
+    emu.flash.chip = cases[c].chip;
+    emu_flash_layout(&emu);
+    emu.flash.erase_us = cases[c].erase_ms * 1000;
+    emu.flash.program_us = 20;
+    emu.flash.bank_read_us = 150000;
+    emu.flash.fail_erase = cases[c].fail_erase;
+    emu.flash.fail_program = cases[c].fail_program;
+
+    flashed = alive = 0;
+    start = get_time_us();
+    pid = bench_start_emulator(&emu, &fd);
+    if (pid != -1) {
+      saved = bench_silence(-1);
+      if (wait_boot_banner(fd) == 0) {
+        flashed = (flash_rom_file(fd, "GBXFLASH.gb", cases[c].type, image.rom_size) == 0);
+        /* the firmware must be back in its command loop, also after a NAK */
+        alive = (get_info(fd) == 0);
+      }
+      bench_silence(saved);
+      bench_stop_emulator(pid, fd);
+    }
 
-  if (get_ram_size(fd, &ram_size)) {
-    printf("Error try again\n");
-    goto L_END_WRITE_RAM;
-  }
+    printf("%-20s %-8lu %10.2f %s%s\n", cases[c].name, cases[c].size, (get_time_us() - start) / 1000000.0,
+           (flashed == cases[c].expect_ok) ? (flashed ? "flashed" : "refused") : (flashed ? "FLASHED" : "FAILED"),
+           alive ? "" : ", NO ANSWER AFTERWARDS");
+    if ((flashed != cases[c].expect_ok) || !alive) failed++;
 
-  if (ram_size > 0) {
-    int i;
-    char option;
-    char clear_option;
-    ssize_t compare_size;
+    remove("GBXFLASH.gb");
+    free(image.rom);
+    free(image.ram);
+    free(emu.rom);
+    free(emu.ram);
+  }
 
-    i = strlen(rom_title);
-    memcpy(ram_filename, rom_title, i + 1);
-    ram_filename[i++] = '.';
-    ram_filename[i++] = 's';
-    ram_filename[i++] = 'a';
-    ram_filename[i++] = 'v';
-    ram_filename[i++] = '\0';
+  return failed;
+}
 
-    if (get_file_size(ram_filename, &compare_size)) {
-      printf("No file found or couldn't open file\n");
-      goto L_END_WRITE_RAM;
-    }
-    if (ram_size != compare_size) {
-      printf("RAM file cannot be used!\n");
-      goto L_END_WRITE_RAM;
-    }
+///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////
+static int run_bench(const char *baseline_path, const char *save_path)
+{
+  FILE *fp;
+  unsigned int r, c, z, i, j;
+  unsigned int count = 0;
+  unsigned int base_count = 0;
+  unsigned int regressions = 0;
+  bench_result *results;
+  bench_result *baseline;
+  char tmp_dir[] = "/tmp/gbx-bench-XXXXXX";
+  char cwd[1024];
+  const unsigned long bauds[] = { 500000, 2000000, 0 };
+  const unsigned long chunks[] = { 64, 512, 4096 };
+  const unsigned long sizes[] = { 0x8000, 0x40000, 0x100000, 0x800000 };
+
+  results = (bench_result *)calloc(BENCH_MAX_RESULTS, sizeof(bench_result)); // assume success
+  baseline = (bench_result *)calloc(BENCH_MAX_RESULTS, sizeof(bench_result)); // assume success
+
+  /* dumps go to a scratch directory */
+  if (!getcwd(cwd, sizeof(cwd)) || !mkdtemp(tmp_dir) || chdir(tmp_dir)) {
+    printf("Error creating bench directory: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
 
-    printf("Use RAM file %s[y/n]? ", ram_filename);
-    option = getchar();
-    do { clear_option = getchar(); } while (clear_option != '\n');
+  assume_yes = 1;
+  crc32_init_table();
 
-    if (option != 'y') {
-      printf("No action done!\n");
-      goto L_END_WRITE_RAM;
+  printf("%-8s %-6s %-8s %-12s %12s %10s %8s %8s %8s %10s\n", "baud", "chunk", "size", "op", "bytes/s", "cpu ms", "p50 ms", "p90 ms", "p99 ms", "baseline");
+  for (r = 0; r < sizeof(bauds) / sizeof(bauds[0]); r++) {
+    for (z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++) {
+      /* ROM + RAM read + RAM write/verify on the emulated wire */
+      if (bauds[r] && ((((sizes[z] + (0x20000 * 3)) * 10) / bauds[r]) > BENCH_TIME_BUDGET)) {
+        printf("%-8lu %-6s %-8lu skipped, over %d s of link time\n", bauds[r], "-", sizes[z], BENCH_TIME_BUDGET);
+        continue;
+      }
+      for (c = 0; (c < sizeof(chunks) / sizeof(chunks[0])) && !ctrlc; c++) {
+        unsigned int n = bench_run_config(bauds[r], chunks[c], sizes[z], results + count);
+        for (i = count; i < count + n; i++) {
+          printf("%-8lu %-6lu %-8lu %-12s %12.1f %10.2f ", results[i].baud, results[i].chunk, results[i].size, results[i].op, results[i].bytes_per_s, results[i].cpu_ms);
+          if (results[i].p50 >= 0) printf("%8.2f %8.2f %8.2f ", results[i].p50, results[i].p90, results[i].p99);
+          else printf("%8s %8s %8s ", "-", "-", "-");
+          printf("\n");
+        }
+        count += n;
+      }
     }
   }
 
-  fp = fopen(ram_filename, "rb");
-  if (!fp) {
-    printf("Error openning %s: %s\n", ram_filename, strerror(errno));
-    goto L_END_WRITE_RAM;
-  }
+  regressions += bench_flash_cases();
 
-  flush_serial(fd);
+  if (chdir(cwd)) printf("Error returning to %s: %s\n", cwd, strerror(errno));
+  rmdir(tmp_dir);
 
-  if (send_packet_routine(fd, WRITE_RAM_COMMAND)) {
+  /* compare with the saved baseline */
+  if (baseline_path && (fp = fopen(baseline_path, "r"))) {
+    while ((base_count < BENCH_MAX_RESULTS) && (fscanf(fp, "%lu %lu %lu %23s %lf %lf %lf %lf %lf",
+           &baseline[base_count].baud, &baseline[base_count].chunk, &baseline[base_count].size, baseline[base_count].op,
+           &baseline[base_count].bytes_per_s, &baseline[base_count].cpu_ms,
+           &baseline[base_count].p50, &baseline[base_count].p90, &baseline[base_count].p99) == 9)) {
+      base_count++;
+    }
     fclose(fp);
-    goto L_END_WRITE_RAM;
-  }
-
-  wait_ms(50); /* give some time */
 
-  if (send_routine_file(fd, fp, ram_size, 1)) {
-    fclose(fp);
-    goto L_END_WRITE_RAM;
+    printf("\nCompared with %s:\n", baseline_path);
+    for (i = 0; i < count; i++) {
+      for (j = 0; j < base_count; j++) {
+        double delta;
+        if ((results[i].baud != baseline[j].baud) || (results[i].chunk != baseline[j].chunk) ||
+            (results[i].size != baseline[j].size) || strcmp(results[i].op, baseline[j].op)) continue;
+        delta = ((results[i].bytes_per_s - baseline[j].bytes_per_s) * 100.0) / baseline[j].bytes_per_s;
+        printf("%-8lu %-6lu %-8lu %-12s %12.1f %+9.1f%%%s\n", results[i].baud, results[i].chunk, results[i].size, results[i].op,
+               results[i].bytes_per_s, delta, (delta < -BENCH_REGRESSION) ? " REGRESSION" : "");
+        if (delta < -BENCH_REGRESSION) regressions++;
+        break;
+      }
+    }
+  }
+  else if (baseline_path) {
+    /* first run on this machine, the next ones compare with it */
+    printf("\nNo baseline %s to compare with, saving this run\n", baseline_path);
+    if (!save_path) save_path = baseline_path;
   }
 
-  verify_ram(fd, fp, ram_size);
+  if (save_path) {
+    fp = fopen(save_path, "w");
+    if (fp) {
+      for (i = 0; i < count; i++) {
+        fprintf(fp, "%lu %lu %lu %s %.1f %.3f %.3f %.3f %.3f\n", results[i].baud, results[i].chunk, results[i].size, results[i].op,
+                results[i].bytes_per_s, results[i].cpu_ms, results[i].p50, results[i].p90, results[i].p99);
+      }
+      fclose(fp);
+      printf("\nBaseline saved to %s\n", save_path);
+    }
+    else {
+      printf("Error creating %s: %s\n", save_path, strerror(errno));
+    }
+  }
 
-  fclose(fp);
+  free(baseline);
+  free(results);
 
-L_END_WRITE_RAM:
-  printf("\n");
+  return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
+#endif /* !(_WIN32 || _WIN64) */
+
 ///////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////
 int main(int argc, char *argv[])
@@ -809,58 +5201,109 @@ int main(int argc, char *argv[])
   int next_option;
 
 #if defined(_WIN32) || defined(_WIN64)
+  char *port_name = NULL;
+  char *replay_path = NULL;
+  double replay_speed = 1.0;
+
   if (argc < 2) {
     printf("\nNO ARGUMENTS PROVIDED!\n");
     print_usage(argv[0]);
     return EXIT_FAILURE;
   }
 
-  fd = CreateFileA(argv[1], GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
-  if (fd == INVALID_HANDLE_VALUE) {
-    printf("Error opening %s: %s\n", argv[1], strerror(errno));
+  /* the port comes first, a replayed session doesn't need one */
+  for (next_option = 1; next_option < argc; next_option++) {
+    if (!strcmp(argv[next_option], "--record") && ((next_option + 1) < argc)) {
+      if (trace_open(argv[++next_option])) return EXIT_FAILURE;
+      continue;
+    }
+    if (!strcmp(argv[next_option], "--replay") && ((next_option + 1) < argc)) {
+      replay_path = argv[++next_option];
+      continue;
+    }
+    if (!strcmp(argv[next_option], "--speed") && ((next_option + 1) < argc)) {
+      replay_speed = atof(argv[++next_option]);
+      continue;
+    }
+    if ((next_option == 1) && (argv[1][0] != '-')) {
+      port_name = argv[1];
+      continue;
+    }
+    if (strstr(argv[next_option], "-v")) verbose = 1;
+    if (strstr(argv[next_option], "-a")) archive_dumps = 1;
+  }
+
+  /* a recorded session stands in for the device */
+  if (replay_path) {
+    if (replay_open(replay_path, replay_speed)) return EXIT_FAILURE;
+    fd = INVALID_HANDLE_VALUE;
+  }
+  else if (!port_name) {
+    printf("\nNO PORT PROVIDED!\n");
+    print_usage(argv[0]);
     return EXIT_FAILURE;
   }
   else {
-    DCB dcb = { 0 };
-    COMMTIMEOUTS tmo = { MAXDWORD, 0, 0, 0, 0 };
-    
-    memset(&dcb, 0, sizeof(DCB));
-    dcb.DCBlength = sizeof(DCB);
-    if (GetCommState(fd, &dcb) == FALSE) {
-      CloseHandle(fd);
-      exit(1);
-    }
-    
-    dcb.BaudRate = SERIAL_BAUDRATE;
-    dcb.ByteSize = 8;
-    dcb.StopBits = ONESTOPBIT;
-    dcb.Parity = NOPARITY;
-    dcb.fAbortOnError = FALSE;
-    if (SetCommState(fd, &dcb) == FALSE) {
-      CloseHandle(fd);
-      exit(1);
+    fd = CreateFileA(port_name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (fd == INVALID_HANDLE_VALUE) {
+      printf("Error opening %s: %s\n", port_name, strerror(errno));
+      return EXIT_FAILURE;
     }
-    
-    if (SetCommTimeouts(fd, &tmo) == FALSE) {
-      CloseHandle(fd);
-      exit(1);
+    else {
+      DCB dcb = { 0 };
+      COMMTIMEOUTS tmo = { MAXDWORD, MAXDWORD, POLL_INTERVAL, 0, 0 };
+      
+      memset(&dcb, 0, sizeof(DCB));
+      dcb.DCBlength = sizeof(DCB);
+      if (GetCommState(fd, &dcb) == FALSE) {
+        CloseHandle(fd);
+        exit(1);
+      }
+      
+      dcb.BaudRate = SERIAL_BAUDRATE;
+      dcb.ByteSize = 8;
+      dcb.StopBits = ONESTOPBIT;
+      dcb.Parity = NOPARITY;
+      dcb.fAbortOnError = FALSE;
+      if (SetCommState(fd, &dcb) == FALSE) {
+        CloseHandle(fd);
+        exit(1);
+      }
+      
+      if (SetCommTimeouts(fd, &tmo) == FALSE) {
+        CloseHandle(fd);
+        exit(1);
+      }
     }
   }
-  if ((argc > 2) && strstr(argv[2], "-v")) verbose = 1;
 
   SetConsoleCtrlHandler(handle_sig, TRUE);
 
 #else
   extern char *optarg;
-  const char* short_options = "p:vh";
+  const char* short_options = "p:vahb";
   const struct option long_options[] = {
-    { "port",         required_argument, NULL, 'p' },
-    { "verbose",      no_argument,       NULL, 'v' },
-    { "help",         no_argument,       NULL, 'h' },
-    { 0,              0,                 0,     0  }
+    { "port",          required_argument, NULL, 'p' },
+    { "verbose",       no_argument,       NULL, 'v' },
+    { "archive",       no_argument,       NULL, 'a' },
+    { "help",          no_argument,       NULL, 'h' },
+    { "bench",         no_argument,       NULL, 'b' },
+    { "baseline",      required_argument, NULL,  1  },
+    { "save-baseline", required_argument, NULL,  2  },
+    { "record",        required_argument, NULL,  3  },
+    { "replay",        required_argument, NULL,  4  },
+    { "speed",         required_argument, NULL,  5  },
+    { "self-test",     no_argument,       NULL,  6  },
+    { 0,               0,                 0,     0  }
   };
 
   char *port_name = NULL;
+  char *baseline_path = NULL;
+  char *save_path = NULL;
+  char *record_path = NULL;
+  char *replay_path = NULL;
+  double replay_speed = 1.0;
+  unsigned char bench = 0;
   struct termios port_attr;
   struct termios port_attr_orig;
   speed_t speed = SERIAL_BAUDRATE;
@@ -881,9 +5324,32 @@ int main(int argc, char *argv[])
       case 'v':
         verbose = 1;
         break;
+      case 'a':
+        archive_dumps = 1;
+        break;
       case 'h':
         print_usage(argv[0]);
         return EXIT_SUCCESS;
+      case 'b':
+        bench = 1;
+        break;
+      case 1:
+        baseline_path = optarg;
+        break;
+      case 2:
+        save_path = optarg;
+        break;
+      case 3:
+        record_path = optarg;
+        break;
+      case 4:
+        replay_path = optarg;
+        break;
+      case 5:
+        replay_speed = atof(optarg);
+        break;
+      case 6:
+        return run_self_test();
       case '?': /* If getopt() encounters an option character that was not in optstring, then '?' is returned */
         print_usage(argv[0]);
         return EXIT_FAILURE;
@@ -895,6 +5361,24 @@ int main(int argc, char *argv[])
     }
   } while (next_option != -1);
 
+  /* benchmark against the firmware stand-in, no device needed */
+  if (bench) {
+    sigaction(SIGINT, &int_handler, 0);
+    return run_bench(baseline_path, save_path);
+  }
+
+  /* Install CTRL^C signal handler */
+  sigaction(SIGINT, &int_handler, 0);
+
+  if (record_path && trace_open(record_path)) return EXIT_FAILURE;
+
+  /* a recorded session stands in for the device */
+  if (replay_path) {
+    if (replay_open(replay_path, replay_speed)) return EXIT_FAILURE;
+    fd = -1;
+    goto L_PORT_READY;
+  }
+
   /* check if setup parameters given and valid */
   if (!port_name) {
     printf("\nSorry, no device provided.\n\n");
@@ -902,9 +5386,6 @@ int main(int argc, char *argv[])
     return EXIT_FAILURE;
   }
 
-  /* Install CTRL^C signal handler */
-  sigaction(SIGINT, &int_handler, 0);
-  
   /* Open serial port */
   fd = open(port_name, O_RDWR);
   if (fd == -1) {
@@ -941,13 +5422,19 @@ int main(int argc, char *argv[])
 
   if (verbose) printf("%s successfully configured.\n", port_name);
 
+L_PORT_READY:
 #endif /* _WIN32 || _WIN64 */
 
   printf("Setting everything up\n");
-  wait_ms(1200); /* delay after arduino reset */
+  crc32_init_table();
+  if (wait_boot_banner(fd)) {
+    /* board without auto-reset, firmware is already waiting for commands */
+    if (verbose) printf("No boot banner received, continuing\n");
+  }
 
   do {
-    char clear_option;
+    char *end;
+    char line[16];
 
     printf("#=========================================================#\n");
     printf("#=============== Arduino-GBx-Reader-Writer ===============#\n");
@@ -955,15 +5442,25 @@ int main(int argc, char *argv[])
     printf("1) Read ROM\n");
     printf("2) Read RAM\n");
     printf("3) Write RAM\n");
-    printf("4) EXIT\n");
+    printf("4) Flash ROM\n");
+    printf("5) Restore RAM from archive\n");
+    printf("6) Inspect cartridge\n");
+    printf("7) Bus timing\n");
+    printf("8) Watch RAM\n");
+    printf("9) Test RAM\n");
+    printf("10) Station mode\n");
+    printf("11) EXIT\n");
     printf("Select an option: ");
-    next_option = getchar();
-    if ((next_option < 48) || (next_option > 57)) {
+    if (!fgets(line, sizeof(line), stdin)) {
+      /* no more input */
+      printf("\n");
+      break;
+    }
+    next_option = strtoul(line, &end, 10);
+    if ((end == line) || ((*end != '\n') && (*end != '\0'))) {
       printf("Invalid option\n");
       continue;
     }
-    do { clear_option = getchar(); } while (clear_option != '\n');
-    next_option -= 48;
 
     printf("#==========================#\n");
     switch (next_option) {
@@ -987,6 +5484,37 @@ int main(int argc, char *argv[])
         write_ram(fd);
         break;
       case 4:
+        flash_rom(fd);
+        break;
+      case 5:
+        *rom_title = 0;
+        read_header(fd, verbose);
+        restore_ram(fd);
+        break;
+      case 6:
+        *rom_title = 0;
+        read_header(fd, verbose);
+        inspect_cartridge(fd);
+        break;
+      case 7:
+        *rom_title = 0;
+        read_header(fd, verbose);
+        bus_timing(fd);
+        break;
+      case 8:
+        *rom_title = 0;
+        read_header(fd, verbose);
+        watch_ram(fd);
+        break;
+      case 9:
+        *rom_title = 0;
+        read_header(fd, verbose);
+        test_ram(fd);
+        break;
+      case 10:
+        station_run(fd);
+        break;
+      case 11:
         ctrlc = 1;
       default:
         break;
@@ -994,19 +5522,29 @@ int main(int argc, char *argv[])
   } while (!ctrlc);
 
   if (verbose && ctrlc) printf("ABORTED OK!\n");
+  if (verbose) printf("Link: %lu stalled transfers, %lu resent commands\n", serial_link.stalls, serial_link.retries);
 
 #if defined(_WIN32) || defined(_WIN64)
-  CloseHandle(fd);
+  if (replay.active) replay_close();
+  else CloseHandle(fd);
 
 #else
-  /* Revert to original port config */
-  if (tcsetattr(fd, TCSANOW, &port_attr_orig) == -1) {
-    printf("Error reverting original port config: %s\n", strerror(errno));
+  if (replay.active) {
+    replay_close();
   }
+  else {
+    /* Revert to original port config */
+    if (tcsetattr(fd, TCSANOW, &port_attr_orig) == -1) {
+      printf("Error reverting original port config: %s\n", strerror(errno));
+    }
 
-  close(fd);
+    close(fd);
+  }
 
 #endif /* _WIN32 || _WIN64 */
 
+  if (trace_fp) fclose(trace_fp);
+  archive_close(&shared_archive);
+
   return EXIT_SUCCESS;
 }